@@ -0,0 +1,62 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Declarations of the wiringPi functions and constants used by ionoPi.c,
+ * so that the benchmarks build without wiringPi installed. The functions
+ * are stubbed in ionoPiBench.c.
+ */
+
+#ifndef BENCH_WIRINGPI_H
+#define BENCH_WIRINGPI_H
+
+#ifndef TRUE
+#define TRUE	(1==1)
+#define FALSE	(!TRUE)
+#endif
+
+#define INPUT				0
+#define OUTPUT				1
+
+#define LOW					0
+#define HIGH				1
+
+#define PUD_OFF				0
+
+#define INT_EDGE_SETUP		0
+#define INT_EDGE_FALLING	1
+#define INT_EDGE_RISING		2
+#define INT_EDGE_BOTH		3
+
+extern int wiringPiSetup(void);
+extern void pinMode(int pin, int mode);
+extern void pullUpDnControl(int pin, int pud);
+extern int digitalRead(int pin);
+extern void digitalWrite(int pin, int value);
+extern int wpiPinToGpio(int wpiPin);
+extern int wiringPiISR(int pin, int mode, void (*function)(void));
+extern void delay(unsigned int howLong);
+
+#endif
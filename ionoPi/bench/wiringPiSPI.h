@@ -0,0 +1,37 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Declarations of the wiringPi SPI functions used by ionoPi.c, stubbed in
+ * ionoPiBench.c.
+ */
+
+#ifndef BENCH_WIRINGPISPI_H
+#define BENCH_WIRINGPISPI_H
+
+extern int wiringPiSPIGetFd(int channel);
+extern int wiringPiSPISetup(int channel, int speed);
+
+#endif
@@ -22,6 +22,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "ionoPi.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,406 +34,3281 @@
 #include <wiringPiSPI.h>
 #include <maxdetect.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <semaphore.h>
+#include <linux/spi/spidev.h>
 #include <sys/time.h>
 
 #define MCP_SPI_CHANNEL 			0
 #define MCP_SPI_SPEED				50000
+#define MCP_SPI_SPEED_MIN			10000
+#define MCP_SPI_SPEED_MAX			2000000
+#define MCP_SPI_SPEED_DIR			"/var/lib/ionopi"
+#define MCP_SPI_SPEED_FILE			MCP_SPI_SPEED_DIR "/mcp3204-speed"
+#define MCP_CHANNELS				4
+
+#define CALIBRATION_SAMPLES			64
+#define CALIBRATION_TOLERANCE		4
 
 #define AI1_AI2_FACTOR 				0.007319f
 #define AI3_AI4_FACTOR 				0.000725f
 
 #define ONEWIRE_DEVICES_PATH "/sys/bus/w1/devices/"
+#define ONEWIRE_CACHE_SIZE			16
+#define ONEWIRE_RESOLUTION_MIN		9
+#define ONEWIRE_RESOLUTION_MAX		12
 
 #define WIEGAND_MAX_BITS			64
 
+#define WIEGAND_SEND_QUEUE_SIZE		16
+#define WIEGAND_SEND_SPIN_USEC		200
+#define WIEGAND_ACCESS_MARGIN_USEC	1000
+
+#define CAPTURE_SAMPLES_MAX			1000000
+
+#define STORM_TOKEN					1000000ULL
+#define STORM_SUMMARY_MILLIS		1000
+
+#define CALLBACK_QUEUE_SIZE_MAX		4096
+#define CALLBACK_READY_SIZE			16
+#define CALLBACK_BATCH				32
+#define CALLBACK_BLOCK_USEC			100
+#define CALLBACK_EVENT_NONE			ULLONG_MAX
+/* pushed in the ready queue to stop a worker */
+#define CALLBACK_WORKER_EXIT		-1
+
+#define GPIO_MEM_PATH				"/dev/gpiomem"
+#define GPIO_MEM_SIZE				4096
+#define GPIO_GPLEV0					13
+
+#define REFLEX_RULES_MAX			64
+#define REFLEX_PENDING_MAX			64
+
+#define THREAD_STACK_SIZE			(64 * 1024)
+
+#define ATOMIC_GET(var)				atomic_load_explicit(&(var), memory_order_relaxed)
+#define ATOMIC_SET(var, val)		atomic_store_explicit(&(var), (val), memory_order_relaxed)
+
+/*
+ * Shared state is accessed through C11 atomics. Groups of fields that must
+ * be read consistently are protected by a seqlock: the sequence number is
+ * odd while a writer is updating them and readers retry if it changed.
+ */
 struct DigitalInputConfig {
-	int digitalInput;
-	int currValue;
-	int debouncedValue;
-	void (*isrCallBack)(void);
-	void (*callBack)(int, int);
-	int callBackMode;
-	struct timespec debounceTime;
-	pthread_t debounceThread;
-	int debounceThreadRunning;
-	pthread_mutex_t mutex;
+	const int digitalInput;
+	void (* const isrCallBack)(void);
+
+	/* configuration, protected by confSeq */
+	atomic_uint confSeq;
+	_Atomic(void (*)(int, int)) callBack;
+	atomic_int callBackMode;
+	atomic_int debounceMillis;
+
+	/* last edge, protected by edgeSeq */
+	atomic_uint edgeSeq;
+	atomic_int currValue;
+	atomic_long edgeSec;
+	atomic_long edgeNsec;
+
+	atomic_int debouncedValue;
+	atomic_int debounceThreadRunning;
+
+	/* edges the interrupt is registered for, 0 if not registered */
+	atomic_int isrMode;
+	/* edges triggering the analog capture, 0 if none */
+	atomic_int triggerMode;
+	/* edges matched by reflex rules, 0 if none */
+	atomic_int reflexMode;
+
+	/* sampled debounce configuration, protected by confSeq */
+	atomic_int sampled;
+	atomic_uint sampleRiseMillis;
+	atomic_uint sampleFallMillis;
+	/* set to restart the debounce from the current level */
+	atomic_int sampleReset;
+	/* integrator, only accessed by the sampler thread */
+	unsigned int sampleCount;
+
+	/* storm protection configuration, protected by stormSeq */
+	atomic_uint stormSeq;
+	atomic_uint stormRate;
+	atomic_uint stormBurst;
+	atomic_uint stormSummaryMillis;
+	_Atomic(void (*)(int, int, unsigned int)) stormCallBack;
+
+	/* token bucket, only accessed by the interrupt thread, refilled and
+	 * restarted from now when stormReset is set */
+	uint64_t stormTokens;
+	struct timespec stormRefill;
+	atomic_int stormReset;
+
+	atomic_int storming;
+	atomic_int stormThreadRunning;
+	atomic_uint stormSuppressed;
+
+	atomic_uint stormCount;
+	atomic_uint stormSuppressedTotal;
+	atomic_uint stormSummaries;
 };
 
-volatile struct DigitalInputConfig diConfs[10];
+extern struct DigitalInputConfig diConfs[10];
 
-volatile struct Wiegand {
-	int64_t data;
-	int bitCount;
-	struct timespec lastBitTs;
-	int run;
-} w1, w2;
+void analogCaptureEdge(struct DigitalInputConfig* diConf);
+void reflexEdge(struct DigitalInputConfig* diConf, int value);
 
-int w1DataRegistered = 0;
-int w2DataRegistered = 0;
+/* from ionoPiAccess.c */
+extern int accessTableMatch(int bitCount, uint64_t data);
 
-struct timespec wiegandPulseWidthMax;
-unsigned long int wiegandPulseIntervalMin_usec;
-unsigned long int wiegandPulseIntervalMax_usec;
+/* from ionoPiStats.c */
+extern atomic_int statsAnalogEnabled[4];
+extern void statsAnalogAdd(int index, int raw);
+extern void stats1WireAdd(const char* deviceId, int temp);
 
 /*
- *
+ * Events of an input waiting to be passed to its callback by the worker
+ * threads. The ring has a single producer, the interrupt or debounce thread
+ * of the input, and a single consumer at a time, the worker that set the
+ * scheduled flag, so that the events of each input are delivered in order.
+ * Each event is the enqueue time in us shifted left by one, or'ed with the
+ * input value.
  */
-int mcp3204Setup() {
-	return (wiringPiSPISetup(MCP_SPI_CHANNEL, MCP_SPI_SPEED) != -1);
-}
+struct CallbackQueue {
+	atomic_ullong* events;
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_ullong pending;
+	atomic_int scheduled;
 
-int isRPiBefore4() {
-	FILE *fp;
-	char model[20];
+	atomic_uint queued;
+	atomic_uint delivered;
+	atomic_uint dropped;
+	atomic_uint coalesced;
+	atomic_uint blocked;
+	atomic_uint maxDepth;
+} cbQueues[10] = { [0 ... 9] = { .pending = CALLBACK_EVENT_NONE } };
 
-	fp = fopen("/proc/device-tree/model", "r");
-	if (fp == NULL) {
-		return TRUE;
-	}
+/*
+ * Inputs with events to deliver, bounded multi-producer multi-consumer
+ * queue. Each input is in the queue at most once.
+ */
+struct CallbackReadyCell {
+	atomic_uint seq;
+	int idx;
+} cbReady[CALLBACK_READY_SIZE];
 
-	fgets(model, 20, (FILE*) fp);
-	fclose(fp);
+atomic_uint cbReadyHead = 0;
+atomic_uint cbReadyTail = 0;
+sem_t cbReadySem;
 
-	if (model[12] != ' ' || model[14] != ' ') {
-		return FALSE;
-	}
+atomic_int cbWorkers = 0;
+atomic_int cbPolicy = IONOPI_CALLBACK_DROP_OLDEST;
+unsigned int cbQueueSize;
+pthread_mutex_t cbMutex = PTHREAD_MUTEX_INITIALIZER;
 
-	if (model[13] == '2' || model[13] == '3') {
-		return TRUE;
-	}
+struct AnalogInputConfig {
+	const int analogInput;
 
-	return FALSE;
-}
+	/* comparator configuration (raw values), protected by cmpSeq */
+	atomic_uint cmpSeq;
+	atomic_int cmpEnabled;
+	atomic_int cmpLow;
+	atomic_int cmpHigh;
+	atomic_int cmpDwellMillis;
+	_Atomic(void (*)(int, int, float)) cmpCallBack;
+
+	/* comparator state, written by the sampler thread only */
+	atomic_int cmpState;
+	int cmpPending;
+	struct timespec cmpPendingSince;
+
+	/* triggered capture, see struct AnalogCapture */
+	atomic_int captureEnabled;
+	int lastRaw;
+	int triggerMode;
+	int triggerLevel;
+	int triggerSkip;
+	int prevRaw;
+} aiConfs[4] = {
+	{ .analogInput = AI1, .cmpState = -1 },
+	{ .analogInput = AI2, .cmpState = -1 },
+	{ .analogInput = AI3, .cmpState = -1 },
+	{ .analogInput = AI4, .cmpState = -1 },
+};
+
+atomic_int mcpSpiSpeed = MCP_SPI_SPEED;
+/* TRUE if set by ionoPiSetAnalogSpeed() or the calibration */
+atomic_int mcpSpiSpeedSet = FALSE;
 
 /*
- * Must be called once at the start of your program execution.
+ * A/D converter access, protected by adcMutex. A single thread at a time
+ * (the leader) runs an SPI transfer converting all the pending channels,
+ * the others wait for the conversions they need on adcCond.
  */
-int ionoPiSetup() {
-	putenv("WIRINGPI_CODES=1");
-	if (wiringPiSetup() != 0) {
-		return FALSE;
-	}
+struct AdcChannel {
+	int value;
+	struct timespec ts;
+	/* incremented at each conversion, 0 if never converted */
+	unsigned int gen;
+	/* requests waiting for the pending and in-flight conversions */
+	unsigned int pendingRequests;
+	unsigned int inflightRequests;
+};
 
-	pinMode(LED, OUTPUT);
+struct AdcStats {
+	unsigned long int requests;
+	unsigned long int cached;
+	unsigned long int merged;
+	unsigned long int conversions;
+	unsigned long int transfers;
+	unsigned long int errors;
+	unsigned long int maxBatch;
+	unsigned long int maxQueue;
+	unsigned long int waits;
+	unsigned long long int sumWait_usec;
+	unsigned long int maxWait_usec;
+	unsigned long int ages;
+	unsigned long long int sumAge_usec;
+	unsigned long int maxAge_usec;
+};
 
-	pinMode(O1, OUTPUT);
-	pinMode(O2, OUTPUT);
-	pinMode(O3, OUTPUT);
-	pinMode(O4, OUTPUT);
+pthread_mutex_t adcMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t adcCond = PTHREAD_COND_INITIALIZER;
+struct AdcChannel adcChannels[MCP_CHANNELS];
+unsigned int adcPending = 0;
+unsigned int adcInflight = 0;
+struct timespec adcInflightTs;
+int adcBusy = FALSE;
+unsigned int adcQueue = 0;
+struct AdcStats adcStats;
+atomic_uint adcFreshness_usec = 0;
 
-	pinMode(OC1, OUTPUT);
-	pinMode(OC2, OUTPUT);
-	pinMode(OC3, OUTPUT);
+atomic_uint digitalPeriod_usec = 0;
+atomic_int digitalSamplerRunning = FALSE;
+/* GPIO level register, NULL if not accessible */
+volatile uint32_t* gpioLevels = NULL;
+int gpioLevelsInit = FALSE;
+int gpioNumbers[10];
 
-	pinMode(DI1, INPUT);
-	pinMode(DI2, INPUT);
-	pinMode(DI3, INPUT);
-	pinMode(DI4, INPUT);
-	pinMode(DI5, INPUT);
-	pinMode(DI6, INPUT);
+atomic_uint analogPeriod_usec = 0;
+atomic_int analogSamplerRunning = FALSE;
+atomic_int analogEventFd = -1;
 
-	if (isRPiBefore4()) {
-		pullUpDnControl(DI1, PUD_OFF);
-		pullUpDnControl(DI2, PUD_OFF);
-		pullUpDnControl(DI3, PUD_OFF);
-		pullUpDnControl(DI4, PUD_OFF);
-		pullUpDnControl(DI5, PUD_OFF);
-		pullUpDnControl(DI6, PUD_OFF);
-	}
+struct Wiegand {
+	/* current frame, protected by seq */
+	atomic_uint seq;
+	atomic_uint dataHi;
+	atomic_uint dataLo;
+	atomic_int bitCount;
+	atomic_long lastBitSec;
+	atomic_long lastBitNsec;
 
-	if (!mcp3204Setup()) {
-		return FALSE;
-	}
+	/* seq value of the last frame handed to the monitor */
+	atomic_uint deliveredSeq;
+	atomic_int run;
+	atomic_int isrRegistered;
 
-	ionoPiSetWiegandPulse(150, 500, 2700);
+	/* access control, see wiegandAccess() */
+	atomic_uint accessSeq;
+	atomic_int accessOutput;
+	atomic_uint accessPulseMillis;
+	atomic_int accessRun;
+	atomic_int accessThreadRunning;
+	atomic_int accessSemInit;
+	atomic_int bitsPending;
+	sem_t accessSem;
+	atomic_ulong accessGranted;
+	atomic_ulong accessDenied;
+} w1, w2;
 
-	return TRUE;
-}
+struct WiegandSender {
+	const int data0;
+	const int data1;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t data[WIEGAND_SEND_QUEUE_SIZE];
+	int bitCount[WIEGAND_SEND_QUEUE_SIZE];
+	int head;
+	int size;
+	int busy;
+	int threadStarted;
+	/* TRUE while the data lines are set as outputs */
+	int output;
+} wSenders[2] = {
+	{ .data0 = TTL1, .data1 = TTL2, .mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER },
+	{ .data0 = TTL3, .data1 = TTL4, .mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER },
+};
+
+struct WiegandPulse {
+	atomic_uint seq;
+	atomic_uint maxWidth_usec;
+	atomic_uint intervalMin_usec;
+	atomic_uint intervalMax_usec;
+} wiegandPulse = { 0, 150, 500, 2700 };
+
+#define SETUP_GPIO					0x100
+
+struct RealtimeConfig {
+	atomic_int priority;
+	atomic_int cpu;
+	/* incremented on every configuration change, 0 if not configured */
+	atomic_uint gen;
+} rtConfs[IONOPI_THREADS] = { [0 ... IONOPI_THREADS - 1] = { 0, -1, 0 } };
+
+/* generation of each configuration last applied by the calling thread */
+__thread unsigned int threadRtGeneration[IONOPI_THREADS];
+
+struct TimingStats {
+	atomic_uint count;
+	atomic_uint errors;
+	atomic_ullong sum_usec;
+	atomic_uint min_usec;
+	atomic_uint max_usec;
+} timingStats[IONOPI_THREADS] = { [0 ... IONOPI_THREADS - 1] = { 0, 0, 0,
+		UINT_MAX, 0 } };
+
+atomic_int setupDone = 0;
+pthread_mutex_t setupMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  *
  */
-void ionoPiPinMode(int pin, int mode) {
-	pinMode(pin, mode);
+unsigned long int to_usec(time_t t_sec, long int t_nsec) {
+	return (t_sec * 1000000UL) + (t_nsec / 1000UL);
 }
 
 /*
  *
  */
-void ionoPiDigitalWrite(int output, int value) {
-	digitalWrite(output, value);
+unsigned long int diff_usec(struct timespec* t1, struct timespec* t2) {
+	time_t diff_sec = t2->tv_sec - t1->tv_sec;
+	long int diff_nsec = t2->tv_nsec - t1->tv_nsec;
+	if (diff_nsec < 0) {
+		diff_sec -= 1;
+		diff_nsec += 1000000000L;
+	}
+	return to_usec(diff_sec, diff_nsec);
 }
 
 /*
- *
+ * Same as diff_usec(), for intervals longer than the ~71 minutes fitting in
+ * 32 bits.
  */
-void *waitAndCallDigitalInterruptCB(void* arg) {
-	volatile struct DigitalInputConfig* diConf =
-			(volatile struct DigitalInputConfig*) arg;
-	int currValue = diConf->currValue;
-	nanosleep((struct timespec *) &(diConf->debounceTime), NULL);
-	if (diConf->debouncedValue != currValue) {
-		diConf->debouncedValue = currValue;
-		if (diConf->callBack != NULL) {
-			if ((diConf->callBackMode == INT_EDGE_RISING && currValue == HIGH)
-					|| (diConf->callBackMode == INT_EDGE_FALLING
-							&& currValue == LOW)
-					|| diConf->callBackMode == INT_EDGE_BOTH) {
-				diConf->callBack(diConf->digitalInput, diConf->debouncedValue);
-			}
-		}
+uint64_t diff_usec64(struct timespec* t1, struct timespec* t2) {
+	int64_t diff_sec = t2->tv_sec - t1->tv_sec;
+	long int diff_nsec = t2->tv_nsec - t1->tv_nsec;
+	if (diff_nsec < 0) {
+		diff_sec -= 1;
+		diff_nsec += 1000000000L;
 	}
-	pthread_mutex_lock((pthread_mutex_t *) &(diConf->mutex));
-	diConf->debounceThreadRunning = FALSE;
-	pthread_mutex_unlock((pthread_mutex_t *) &(diConf->mutex));
-	return NULL;
+	return diff_sec * 1000000ULL + diff_nsec / 1000;
 }
 
 /*
  *
  */
-void digitalInterruptCB(int idx) {
-	volatile struct DigitalInputConfig* diConf = &diConfs[idx];
-	if (diConf->debounceTime.tv_sec == 0 && diConf->debounceTime.tv_nsec == 0) {
-		if (diConf->callBack != NULL) {
-			if (diConf->callBackMode == INT_EDGE_RISING) {
-				diConf->callBack(diConf->digitalInput, HIGH);
-			} else if (diConf->callBackMode == INT_EDGE_FALLING) {
-				diConf->callBack(diConf->digitalInput, LOW);
-			} else {
-				diConf->callBack(diConf->digitalInput,
-						digitalRead(diConf->digitalInput));
-			}
-		}
-	} else {
-		pthread_mutex_lock((pthread_mutex_t *) &(diConf->mutex));
-		diConf->currValue = digitalRead(diConf->digitalInput);
-		if (diConf->debounceThreadRunning) {
-			pthread_cancel(diConf->debounceThread);
-		}
-		int err = pthread_create((pthread_t *) &(diConf->debounceThread), NULL,
-				waitAndCallDigitalInterruptCB, (void *) diConf);
-		if (err == 0) {
-			diConf->debounceThreadRunning = TRUE;
-			pthread_detach(diConf->debounceThread);
-		} else {
-			fprintf(stderr, "error creating new thread [%d]\n", err);
-		}
-		pthread_mutex_unlock((pthread_mutex_t *) &(diConf->mutex));
+void addMicros(struct timespec* t, unsigned long int usec) {
+	t->tv_sec += usec / 1000000;
+	t->tv_nsec += (usec % 1000000) * 1000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec += 1;
+		t->tv_nsec -= 1000000000L;
 	}
 }
 
-void di1InterruptCB() {
-	digitalInterruptCB(0);
-}
-
-void di2InterruptCB() {
-	digitalInterruptCB(1);
-}
-
-void di3InterruptCB() {
-	digitalInterruptCB(2);
-}
-
-void di4InterruptCB() {
-	digitalInterruptCB(3);
-}
-
-void di5InterruptCB() {
-	digitalInterruptCB(4);
+/*
+ * Like addMicros(), for intervals longer than 32 bits of microseconds.
+ */
+void addMillis(struct timespec* t, uint64_t msec) {
+	t->tv_sec += msec / 1000;
+	t->tv_nsec += (msec % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec += 1;
+		t->tv_nsec -= 1000000000L;
+	}
 }
 
-void di6InterruptCB() {
-	digitalInterruptCB(5);
+/*
+ * Returns TRUE if a is earlier than b.
+ */
+int timeBefore(struct timespec* a, struct timespec* b) {
+	return a->tv_sec < b->tv_sec
+			|| (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
 }
 
-void ttl1InterruptCB() {
-	digitalInterruptCB(6);
+/*
+ * Starts a seqlock write section, waiting for other writers to complete.
+ * Returns the (even) sequence number before the update.
+ */
+unsigned int seqWriteBegin(atomic_uint* seq) {
+	unsigned int s;
+	for (;;) {
+		s = atomic_load_explicit(seq, memory_order_relaxed);
+		if ((s & 1) == 0
+				&& atomic_compare_exchange_weak_explicit(seq, &s, s + 1,
+						memory_order_acquire, memory_order_relaxed)) {
+			break;
+		}
+	}
+	atomic_thread_fence(memory_order_release);
+	return s;
 }
 
-void ttl2InterruptCB() {
-	digitalInterruptCB(7);
+void seqWriteEnd(atomic_uint* seq) {
+	atomic_fetch_add(seq, 1);
 }
 
-void ttl3InterruptCB() {
-	digitalInterruptCB(8);
+unsigned int seqReadBegin(atomic_uint* seq) {
+	unsigned int s;
+	while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1) {
+	}
+	return s;
 }
 
-void ttl4InterruptCB() {
-	digitalInterruptCB(9);
+int seqReadRetry(atomic_uint* seq, unsigned int s) {
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(seq, memory_order_relaxed) != s;
 }
 
 /*
- *
+ * Applies the scheduling configuration of the given library thread type to
+ * the calling thread, if changed since last applied. Threads of a type never
+ * configured are left with their own scheduling.
  */
-volatile struct DigitalInputConfig* getDigitalInputConfig(int di) {
-	int idx;
-	void (*isrCallBack)(void);
-	switch (di) {
-	case DI1:
-		idx = 0;
-		isrCallBack = di1InterruptCB;
-		break;
-	case DI2:
-		idx = 1;
-		isrCallBack = di2InterruptCB;
-		break;
-	case DI3:
-		idx = 2;
-		isrCallBack = di3InterruptCB;
-		break;
-	case DI4:
-		idx = 3;
-		isrCallBack = di4InterruptCB;
-		break;
-	case DI5:
-		idx = 4;
-		isrCallBack = di5InterruptCB;
-		break;
-	case DI6:
-		idx = 5;
-		isrCallBack = di6InterruptCB;
-		break;
-	case TTL1:
-		idx = 6;
-		isrCallBack = ttl1InterruptCB;
-		break;
-	case TTL2:
-		idx = 7;
-		isrCallBack = ttl2InterruptCB;
-		break;
-	case TTL3:
-		idx = 8;
-		isrCallBack = ttl3InterruptCB;
-		break;
-	case TTL4:
-		idx = 9;
-		isrCallBack = ttl4InterruptCB;
-		break;
-	default:
-		return NULL;
+void checkRealtime(int thread) {
+	unsigned int gen = atomic_load_explicit(&rtConfs[thread].gen,
+			memory_order_acquire);
+	if (gen == threadRtGeneration[thread]) {
+		return;
 	}
+	threadRtGeneration[thread] = gen;
 
-	diConfs[idx].digitalInput = di;
-	diConfs[idx].isrCallBack = isrCallBack;
+	struct sched_param param;
+	int priority = ATOMIC_GET(rtConfs[thread].priority);
+	int cpu = ATOMIC_GET(rtConfs[thread].cpu);
+	param.sched_priority = priority;
+	pthread_setschedparam(pthread_self(), priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+			&param);
 
-	return &diConfs[idx];
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (cpu >= 0) {
+		CPU_SET(cpu, &cpus);
+	} else {
+		int i, n = sysconf(_SC_NPROCESSORS_CONF);
+		for (i = 0; i < n && i < CPU_SETSIZE; i++) {
+			CPU_SET(i, &cpus);
+		}
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
 }
 
 /*
  *
  */
-void ionoPiSetDigitalDebounce(int di, int millis) {
-	volatile struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
-	if (diConf == NULL) {
-		return;
+void recordTiming(int thread, unsigned long int usec) {
+	struct TimingStats* ts = &timingStats[thread];
+	unsigned int v = usec > UINT_MAX ? UINT_MAX : usec;
+	unsigned int curr;
+
+	atomic_fetch_add_explicit(&ts->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ts->sum_usec, v, memory_order_relaxed);
+	curr = ATOMIC_GET(ts->min_usec);
+	while (v < curr
+			&& !atomic_compare_exchange_weak_explicit(&ts->min_usec, &curr, v,
+					memory_order_relaxed, memory_order_relaxed)) {
 	}
-	diConf->debounceTime.tv_sec = millis / 1000;
-	diConf->debounceTime.tv_nsec = (millis % 1000) * 1000000L;
-	pinMode(di, INPUT);
-	if (millis != 0) {
-		pthread_mutex_lock((pthread_mutex_t *) &(diConf->mutex));
-		if (diConf->debounceThreadRunning) {
-			pthread_cancel(diConf->debounceThread);
-		}
-		diConf->debounceThreadRunning = FALSE;
-		diConf->debouncedValue = digitalRead(di);
-		wiringPiISR(di, INT_EDGE_BOTH, diConf->isrCallBack);
-		pthread_mutex_unlock((pthread_mutex_t *) &(diConf->mutex));
+	curr = ATOMIC_GET(ts->max_usec);
+	while (v > curr
+			&& !atomic_compare_exchange_weak_explicit(&ts->max_usec, &curr, v,
+					memory_order_relaxed, memory_order_relaxed)) {
 	}
 }
 
 /*
  *
  */
-int ionoPiDigitalRead(int di) {
-	volatile struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
-	if (diConf == NULL) {
-		return digitalRead(di);
+int mcp3204Setup() {
+	// use the calibrated speed, unless set explicitly
+	FILE *fp = !ATOMIC_GET(mcpSpiSpeedSet) ?
+			fopen(MCP_SPI_SPEED_FILE, "r") : NULL;
+	if (fp != NULL) {
+		int speed;
+		if (fscanf(fp, "%d", &speed) == 1 && speed >= MCP_SPI_SPEED_MIN
+				&& speed <= MCP_SPI_SPEED_MAX
+				&& !ATOMIC_GET(mcpSpiSpeedSet)) {
+			ATOMIC_SET(mcpSpiSpeed, speed);
+		}
+		fclose(fp);
 	}
-	if (diConf->debounceTime.tv_sec == 0 && diConf->debounceTime.tv_nsec == 0) {
-		return digitalRead(di);
-	} else {
-		return diConf->debouncedValue;
+	return (wiringPiSPISetup(MCP_SPI_CHANNEL, ATOMIC_GET(mcpSpiSpeed)) != -1);
+}
+
+int isRPiBefore4() {
+	static int cached = -1;
+	FILE *fp;
+	char model[20];
+
+	if (cached >= 0) {
+		return cached;
+	}
+
+	fp = fopen("/proc/device-tree/model", "r");
+	if (fp == NULL) {
+		return (cached = TRUE);
+	}
+
+	if (fgets(model, 20, (FILE*) fp) == NULL) {
+		model[0] = '\0';
+	}
+	fclose(fp);
+
+	if (strlen(model) < 15 || model[12] != ' ' || model[14] != ' ') {
+		return (cached = FALSE);
+	}
+
+	if (model[13] == '2' || model[13] == '3') {
+		return (cached = TRUE);
 	}
+
+	return (cached = FALSE);
 }
 
 /*
- *
+ * Initializes the subsystems in flags not yet initialized.
+ * SETUP_GPIO is wiringPi's GPIO access, needed by all pin-based subsystems.
  */
-int ionoPiDigitalInterrupt(int di, int mode, void (*callBack)(int, int)) {
-	volatile struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
-	if (diConf == NULL) {
-		return FALSE;
+int setupSubsystems(int flags) {
+	int ok = TRUE;
+
+	if ((atomic_load_explicit(&setupDone, memory_order_acquire) & flags)
+			== flags) {
+		return TRUE;
 	}
-	diConf->callBack = callBack;
-	diConf->callBackMode = mode;
-	if (callBack != NULL) {
-		if (diConf->debounceTime.tv_sec == 0
-				&& diConf->debounceTime.tv_nsec == 0) {
-			wiringPiISR(di, mode, diConf->isrCallBack);
+
+	pthread_mutex_lock(&setupMutex);
+
+	if ((flags & (IONOPI_SETUP_LED | IONOPI_SETUP_OUTPUTS | IONOPI_SETUP_INPUTS))
+			!= 0) {
+		flags |= SETUP_GPIO;
+	}
+	flags &= ~ATOMIC_GET(setupDone);
+
+	if (flags & SETUP_GPIO) {
+		putenv("WIRINGPI_CODES=1");
+		if (wiringPiSetup() != 0) {
+			pthread_mutex_unlock(&setupMutex);
+			return FALSE;
+		}
+		atomic_fetch_or(&setupDone, SETUP_GPIO);
+	}
+
+	if (flags & IONOPI_SETUP_LED) {
+		pinMode(LED, OUTPUT);
+		atomic_fetch_or(&setupDone, IONOPI_SETUP_LED);
+	}
+
+	if (flags & IONOPI_SETUP_OUTPUTS) {
+		pinMode(O1, OUTPUT);
+		pinMode(O2, OUTPUT);
+		pinMode(O3, OUTPUT);
+		pinMode(O4, OUTPUT);
+
+		pinMode(OC1, OUTPUT);
+		pinMode(OC2, OUTPUT);
+		pinMode(OC3, OUTPUT);
+		atomic_fetch_or(&setupDone, IONOPI_SETUP_OUTPUTS);
+	}
+
+	if (flags & IONOPI_SETUP_INPUTS) {
+		pinMode(DI1, INPUT);
+		pinMode(DI2, INPUT);
+		pinMode(DI3, INPUT);
+		pinMode(DI4, INPUT);
+		pinMode(DI5, INPUT);
+		pinMode(DI6, INPUT);
+
+		if (isRPiBefore4()) {
+			pullUpDnControl(DI1, PUD_OFF);
+			pullUpDnControl(DI2, PUD_OFF);
+			pullUpDnControl(DI3, PUD_OFF);
+			pullUpDnControl(DI4, PUD_OFF);
+			pullUpDnControl(DI5, PUD_OFF);
+			pullUpDnControl(DI6, PUD_OFF);
+		}
+		atomic_fetch_or(&setupDone, IONOPI_SETUP_INPUTS);
+	}
+
+	if (flags & IONOPI_SETUP_ANALOG) {
+		if (mcp3204Setup()) {
+			atomic_fetch_or(&setupDone, IONOPI_SETUP_ANALOG);
 		} else {
-			wiringPiISR(di, INT_EDGE_BOTH, diConf->isrCallBack);
+			ok = FALSE;
 		}
 	}
 
-	return TRUE;
+	pthread_mutex_unlock(&setupMutex);
+	return ok;
 }
 
 /*
- *
+ * Must be called once at the start of your program execution.
  */
-int mcp3204Read(unsigned char channel) {
-	/*
-	 * See http://ww1.microchip.com/downloads/en/DeviceDoc/21298c.pdf Page 18
-	 *
-	 * 1st byte: 0 0 0 0 0 1 SGL/DIFF D2 = 0 0 0 0 0 1 1 0
-	 *
-	 * 2nd byte: D1 D0 X X X X X X
-	 *
-	 * 3rd byte: X X X X X X X X
-	 *
-	 */
-	unsigned char data[3];
-	data[0] = 0b110;
-	data[1] = channel;
-
-	if (wiringPiSPIDataRW(MCP_SPI_CHANNEL, data, 3) < 0) {
-		return -1;
+int ionoPiSetup() {
+	if (!ionoPiSetupEx(IONOPI_SETUP_ALL)) {
+		return FALSE;
 	}
 
-	int val = ((data[1] & 0x0F) << 8) + (data[2] & 0xFF);
-	return val;
+	ionoPiSetWiegandPulse(150, 500, 2700);
+
+	return TRUE;
 }
 
 /*
- *
+ * Initializes GPIO access and only the subsystems specified in flags.
+ * The analog inputs, 1-Wire and Wiegand are otherwise set up on first use.
  */
-int ionoPiAnalogRead(int ai) {
-	int v = mcp3204Read(ai);
-	if (v < 0) {
-		return -1;
-	}
-	return v;
+int ionoPiSetupEx(int flags) {
+	return setupSubsystems((flags & IONOPI_SETUP_ALL) | SETUP_GPIO);
 }
 
 /*
  *
  */
-float ionoPiVoltageRead(int ai) {
-	int v = mcp3204Read(ai);
-	if (v < 0) {
-		return -1;
+int ionoPiSetRealtime(int thread, int priority, int cpu) {
+	if (thread < 0 || thread >= IONOPI_THREADS || priority < 0
+			|| priority > sched_get_priority_max(SCHED_FIFO)
+			|| cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+		return FALSE;
+	}
+	ATOMIC_SET(rtConfs[thread].priority, priority);
+	ATOMIC_SET(rtConfs[thread].cpu, cpu < 0 ? -1 : cpu);
+	// skipping 0, which means not configured
+	if (atomic_fetch_add(&rtConfs[thread].gen, 1) == UINT_MAX) {
+		atomic_fetch_add(&rtConfs[thread].gen, 1);
 	}
+	return TRUE;
+}
 
-	float factor;
-	if (ai == AI1 || ai == AI2) {
-		factor = AI1_AI2_FACTOR;
-	} else {
+/*
+ * Threads created after this call, including the wiringPi interrupt
+ * threads, get stacks of stackSize bytes, which are locked in memory and
+ * fully allocated at creation.
+ */
+int ionoPiLockMemory(unsigned int stackSize) {
+	pthread_attr_t attr;
+	if (stackSize == 0) {
+		stackSize = THREAD_STACK_SIZE;
+	}
+	if (stackSize < PTHREAD_STACK_MIN) {
+		stackSize = PTHREAD_STACK_MIN;
+	}
+	if (pthread_attr_init(&attr) != 0) {
+		return FALSE;
+	}
+	int err = pthread_attr_setstacksize(&attr, stackSize);
+	if (err == 0) {
+		err = pthread_setattr_default_np(&attr);
+	}
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		return FALSE;
+	}
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+/*
+ *
+ */
+int ionoPiGetTimingStats(int thread, struct IonoPiTimingStats* stats,
+		int reset) {
+	if (thread < 0 || thread >= IONOPI_THREADS || stats == NULL) {
+		return FALSE;
+	}
+	struct TimingStats* ts = &timingStats[thread];
+	unsigned int count = ATOMIC_GET(ts->count);
+	stats->count = count;
+	stats->errors = ATOMIC_GET(ts->errors);
+	stats->minMicros = count > 0 ? ATOMIC_GET(ts->min_usec) : 0;
+	stats->maxMicros = ATOMIC_GET(ts->max_usec);
+	stats->meanMicros = count > 0 ? ATOMIC_GET(ts->sum_usec) / count : 0;
+	if (reset) {
+		ATOMIC_SET(ts->count, 0);
+		ATOMIC_SET(ts->errors, 0);
+		ATOMIC_SET(ts->sum_usec, 0);
+		ATOMIC_SET(ts->min_usec, UINT_MAX);
+		ATOMIC_SET(ts->max_usec, 0);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+void ionoPiPinMode(int pin, int mode) {
+	pinMode(pin, mode);
+}
+
+/*
+ *
+ */
+void ionoPiDigitalWrite(int output, int value) {
+	digitalWrite(output, value);
+}
+
+/*
+ *
+ */
+void readDigitalInputConf(struct DigitalInputConfig* diConf,
+		void (**callBack)(int, int), int *mode, int *debounceMillis) {
+	unsigned int seq;
+	do {
+		seq = seqReadBegin(&diConf->confSeq);
+		*callBack = ATOMIC_GET(diConf->callBack);
+		*mode = ATOMIC_GET(diConf->callBackMode);
+		*debounceMillis = ATOMIC_GET(diConf->debounceMillis);
+	} while (seqReadRetry(&diConf->confSeq, seq));
+}
+
+/*
+ *
+ */
+void callbackReadyPush(int idx) {
+	unsigned int pos = atomic_load_explicit(&cbReadyTail, memory_order_relaxed);
+	struct CallbackReadyCell* cell;
+	for (;;) {
+		cell = &cbReady[pos % CALLBACK_READY_SIZE];
+		unsigned int seq = atomic_load_explicit(&cell->seq,
+				memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&cbReadyTail, &pos,
+					pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else {
+			pos = atomic_load_explicit(&cbReadyTail, memory_order_relaxed);
+		}
+	}
+	cell->idx = idx;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	sem_post(&cbReadySem);
+}
+
+/*
+ * To be called after a successful sem_wait() on cbReadySem.
+ */
+int callbackReadyPop() {
+	unsigned int pos = atomic_load_explicit(&cbReadyHead, memory_order_relaxed);
+	struct CallbackReadyCell* cell;
+	for (;;) {
+		cell = &cbReady[pos % CALLBACK_READY_SIZE];
+		unsigned int seq = atomic_load_explicit(&cell->seq,
+				memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(&cbReadyHead, &pos,
+					pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else {
+			pos = atomic_load_explicit(&cbReadyHead, memory_order_relaxed);
+		}
+	}
+	int idx = cell->idx;
+	atomic_store_explicit(&cell->seq, pos + CALLBACK_READY_SIZE,
+			memory_order_release);
+	return idx;
+}
+
+/*
+ *
+ */
+void callbackSchedule(int idx) {
+	if (!atomic_exchange(&cbQueues[idx].scheduled, TRUE)) {
+		callbackReadyPush(idx);
+	}
+}
+
+/*
+ * Queues an event for the callback of the input, applying the overflow
+ * policy when the queue is full.
+ */
+void callbackEnqueue(struct DigitalInputConfig* diConf, int value) {
+	int idx = diConf - diConfs;
+	struct CallbackQueue* q = &cbQueues[idx];
+	struct timespec now;
+	unsigned int head, tail, depth, max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long event = ((now.tv_sec * 1000000ULL
+			+ now.tv_nsec / 1000) << 1) | (value ? 1 : 0);
+	int policy = ATOMIC_GET(cbPolicy);
+
+	atomic_fetch_add_explicit(&q->queued, 1, memory_order_relaxed);
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	if (policy == IONOPI_CALLBACK_COALESCE
+			&& atomic_load(&q->pending) != CALLBACK_EVENT_NONE) {
+		// later events must not overtake the pending one
+		if (atomic_exchange(&q->pending, event) != CALLBACK_EVENT_NONE) {
+			atomic_fetch_add_explicit(&q->coalesced, 1, memory_order_relaxed);
+		}
+		callbackSchedule(idx);
+		return;
+	}
+
+	for (;;) {
+		head = atomic_load(&q->head);
+		if (tail - head < cbQueueSize) {
+			break;
+		}
+		if (policy == IONOPI_CALLBACK_COALESCE) {
+			if (atomic_exchange(&q->pending, event) != CALLBACK_EVENT_NONE) {
+				atomic_fetch_add_explicit(&q->coalesced, 1,
+						memory_order_relaxed);
+			}
+			callbackSchedule(idx);
+			return;
+		} else if (policy == IONOPI_CALLBACK_BLOCK) {
+			atomic_fetch_add_explicit(&q->blocked, 1, memory_order_relaxed);
+			callbackSchedule(idx);
+			do {
+				usleep(CALLBACK_BLOCK_USEC);
+			} while (tail - atomic_load(&q->head) >= cbQueueSize);
+		} else if (atomic_compare_exchange_strong(&q->head, &head,
+				head + 1)) {
+			atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+			break;
+		}
+	}
+
+	atomic_store_explicit(&q->events[tail % cbQueueSize], event,
+			memory_order_relaxed);
+	atomic_store(&q->tail, tail + 1);
+
+	depth = tail + 1 - atomic_load(&q->head);
+	max = ATOMIC_GET(q->maxDepth);
+	while (depth > max
+			&& !atomic_compare_exchange_weak_explicit(&q->maxDepth, &max,
+					depth, memory_order_relaxed, memory_order_relaxed)) {
+	}
+
+	callbackSchedule(idx);
+}
+
+/*
+ * Takes the next event of the queue, the coalesced one last.
+ */
+int callbackDequeue(struct CallbackQueue* q, unsigned long long* event) {
+	unsigned int head = atomic_load(&q->head);
+	for (;;) {
+		if (head == atomic_load(&q->tail)) {
+			*event = atomic_exchange(&q->pending, CALLBACK_EVENT_NONE);
+			return *event != CALLBACK_EVENT_NONE;
+		}
+		*event = atomic_load_explicit(&q->events[head % cbQueueSize],
+				memory_order_relaxed);
+		// fails if the producer dropped the event meanwhile
+		if (atomic_compare_exchange_strong(&q->head, &head, head + 1)) {
+			return TRUE;
+		}
+	}
+}
+
+/*
+ * Passes the events of the scheduled inputs to their callbacks. An input is
+ * handled by one worker at a time and is rescheduled after a batch of
+ * events, so that a busy input does not starve the others.
+ */
+void *callbackWorker(void* arg) {
+	struct DigitalInputConfig* diConf;
+	struct CallbackQueue* q;
+	unsigned long long event;
+	void (*callBack)(int, int);
+	int mode, debounceMillis, idx, n;
+	struct timespec now;
+
+	for (;;) {
+		while (sem_wait(&cbReadySem) != 0) {
+		}
+		checkRealtime(IONOPI_THREAD_CALLBACK);
+		idx = callbackReadyPop();
+		if (idx == CALLBACK_WORKER_EXIT) {
+			return NULL;
+		}
+		diConf = &diConfs[idx];
+		q = &cbQueues[idx];
+
+		for (n = 0; n < CALLBACK_BATCH && callbackDequeue(q, &event); n++) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			unsigned long long now_usec = now.tv_sec * 1000000ULL
+					+ now.tv_nsec / 1000;
+			unsigned long long ts_usec = event >> 1;
+			recordTiming(IONOPI_THREAD_CALLBACK,
+					now_usec > ts_usec ? now_usec - ts_usec : 0);
+			readDigitalInputConf(diConf, &callBack, &mode, &debounceMillis);
+			if (callBack != NULL) {
+				callBack(diConf->digitalInput, (int) (event & 1));
+			}
+			atomic_fetch_add_explicit(&q->delivered, 1, memory_order_relaxed);
+		}
+
+		atomic_store(&q->scheduled, FALSE);
+		// an event may have been queued before the flag was cleared
+		if ((atomic_load(&q->head) != atomic_load(&q->tail)
+				|| atomic_load(&q->pending) != CALLBACK_EVENT_NONE)) {
+			callbackSchedule(idx);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Calls the callback directly or queues the event for the worker threads.
+ */
+void dispatchInterruptCB(struct DigitalInputConfig* diConf,
+		void (*callBack)(int, int), int value) {
+	if (atomic_load_explicit(&cbWorkers, memory_order_acquire) > 0) {
+		callbackEnqueue(diConf, value);
+	} else {
+		callBack(diConf->digitalInput, value);
+	}
+}
+
+/*
+ *
+ */
+void callDebouncedInterruptCB(struct DigitalInputConfig* diConf, int value) {
+	void (*callBack)(int, int);
+	int mode, debounceMillis;
+	readDigitalInputConf(diConf, &callBack, &mode, &debounceMillis);
+	if (callBack != NULL) {
+		if ((mode == INT_EDGE_RISING && value == HIGH)
+				|| (mode == INT_EDGE_FALLING && value == LOW)
+				|| mode == INT_EDGE_BOTH) {
+			dispatchInterruptCB(diConf, callBack, value);
+		}
+	}
+}
+
+/*
+ * Runs until the input has been stable for the debounce time after its last
+ * edge. A single thread is running per input at any time; edges occurring
+ * meanwhile just extend its wait.
+ */
+void *debounceDigitalInput(void* arg) {
+	struct DigitalInputConfig* diConf = (struct DigitalInputConfig*) arg;
+	struct timespec deadline;
+	struct timespec now;
+	unsigned int seq;
+	int value, debounceMillis;
+
+	checkRealtime(IONOPI_THREAD_DEBOUNCE);
+
+	for (;;) {
+		do {
+			seq = seqReadBegin(&diConf->edgeSeq);
+			value = ATOMIC_GET(diConf->currValue);
+			deadline.tv_sec = ATOMIC_GET(diConf->edgeSec);
+			deadline.tv_nsec = ATOMIC_GET(diConf->edgeNsec);
+		} while (seqReadRetry(&diConf->edgeSeq, seq));
+
+		debounceMillis = ATOMIC_GET(diConf->debounceMillis);
+		deadline.tv_sec += debounceMillis / 1000;
+		deadline.tv_nsec += (debounceMillis % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+				NULL) == EINTR) {
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		recordTiming(IONOPI_THREAD_DEBOUNCE, diff_usec(&deadline, &now));
+
+		if (atomic_load(&diConf->edgeSeq) != seq) {
+			continue;
+		}
+
+		if (atomic_load(&diConf->sampled)) {
+			// switched to sampled debounce, the sampler dispatches
+			atomic_store(&diConf->debounceThreadRunning, FALSE);
+			break;
+		}
+
+		if (atomic_exchange(&diConf->debouncedValue, value) != value) {
+			if (ATOMIC_GET(diConf->reflexMode) != 0) {
+				reflexEdge(diConf, value);
+			}
+			callDebouncedInterruptCB(diConf, value);
+		}
+
+		atomic_store(&diConf->debounceThreadRunning, FALSE);
+		// an edge may have come before the flag was cleared
+		if (atomic_load(&diConf->edgeSeq) == seq
+				|| atomic_exchange(&diConf->debounceThreadRunning, TRUE)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Records an edge and starts the debounce thread if not running.
+ */
+void debounceEdge(struct DigitalInputConfig* diConf) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int value = digitalRead(diConf->digitalInput);
+
+	seqWriteBegin(&diConf->edgeSeq);
+	ATOMIC_SET(diConf->currValue, value);
+	ATOMIC_SET(diConf->edgeSec, now.tv_sec);
+	ATOMIC_SET(diConf->edgeNsec, now.tv_nsec);
+	seqWriteEnd(&diConf->edgeSeq);
+
+	if (!atomic_exchange(&diConf->debounceThreadRunning, TRUE)) {
+		pthread_t thread;
+		int err;
+		// the input may have been switched to sampled debounce since the
+		// interrupt checked it
+		if (atomic_load(&diConf->sampled)) {
+			atomic_store(&diConf->debounceThreadRunning, FALSE);
+			return;
+		}
+		err = pthread_create(&thread, NULL, debounceDigitalInput,
+				(void *) diConf);
+		if (err == 0) {
+			pthread_detach(thread);
+		} else {
+			atomic_store(&diConf->debounceThreadRunning, FALSE);
+			fprintf(stderr, "error creating new thread [%d]\n", err);
+		}
+	}
+}
+
+/*
+ * Maps the GPIO registers to read the levels of all the inputs at once.
+ * The mapping is checked against digitalRead() and not used if they
+ * differ, e.g. on models with a different GPIO controller.
+ */
+void digitalLevelsSetup() {
+	int i, fd;
+	void* map;
+	gpioLevelsInit = TRUE;
+	fd = open(GPIO_MEM_PATH, O_RDWR | O_SYNC);
+	if (fd < 0) {
+		return;
+	}
+	map = mmap(NULL, GPIO_MEM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+	volatile uint32_t* lev = (volatile uint32_t*) map + GPIO_GPLEV0;
+	for (i = 0; i < 10; i++) {
+		int gpio = wpiPinToGpio(diConfs[i].digitalInput);
+		if (gpio < 0 || gpio > 31
+				|| ((*lev >> gpio) & 1) != (uint32_t) digitalRead(
+						diConfs[i].digitalInput)) {
+			munmap(map, GPIO_MEM_SIZE);
+			return;
+		}
+		gpioNumbers[i] = gpio;
+	}
+	gpioLevels = lev;
+}
+
+/*
+ * Returns the levels of the sampled inputs, bit i for diConfs[i].
+ */
+unsigned int digitalLevels() {
+	unsigned int levels = 0;
+	int i;
+	if (gpioLevels != NULL) {
+		uint32_t lev = *gpioLevels;
+		for (i = 0; i < 10; i++) {
+			levels |= ((lev >> gpioNumbers[i]) & 1) << i;
+		}
+	} else {
+		for (i = 0; i < 10; i++) {
+			if (ATOMIC_GET(diConfs[i].sampled)) {
+				levels |= (digitalRead(diConfs[i].digitalInput) == HIGH) << i;
+			}
+		}
+	}
+	return levels;
+}
+
+/*
+ *
+ */
+unsigned int millisToSamples(unsigned int millis, unsigned int period_usec) {
+	unsigned int samples = ((uint64_t) millis * 1000 + period_usec - 1)
+			/ period_usec;
+	return samples > 0 ? samples : 1;
+}
+
+/*
+ * Integrating debounce: the counter moves towards the sampled level by one
+ * on each sample and the state changes when it reaches the rise count, or
+ * zero from the fall count, so that bounces only delay the change.
+ */
+void digitalSample(struct DigitalInputConfig* diConf, int level,
+		unsigned int period_usec) {
+	unsigned int seq, riseMillis, fallMillis, rise, fall;
+	int value;
+
+	do {
+		seq = seqReadBegin(&diConf->confSeq);
+		riseMillis = ATOMIC_GET(diConf->sampleRiseMillis);
+		fallMillis = ATOMIC_GET(diConf->sampleFallMillis);
+	} while (seqReadRetry(&diConf->confSeq, seq));
+	rise = millisToSamples(riseMillis, period_usec);
+	fall = millisToSamples(fallMillis, period_usec);
+
+	if (atomic_exchange(&diConf->sampleReset, FALSE)) {
+		atomic_store(&diConf->debouncedValue, level);
+		diConf->sampleCount = level == HIGH ? fall : 0;
+		return;
+	}
+
+	value = ATOMIC_GET(diConf->debouncedValue);
+	if (value == LOW) {
+		if (level == HIGH) {
+			diConf->sampleCount++;
+		} else if (diConf->sampleCount > 0) {
+			diConf->sampleCount--;
+		}
+		if (diConf->sampleCount >= rise) {
+			diConf->sampleCount = fall;
+			value = HIGH;
+		}
+	} else {
+		if (diConf->sampleCount > fall) {
+			diConf->sampleCount = fall;
+		}
+		if (level == LOW) {
+			diConf->sampleCount--;
+		} else if (diConf->sampleCount < fall) {
+			diConf->sampleCount++;
+		}
+		if (diConf->sampleCount == 0) {
+			value = LOW;
+		}
+	}
+
+	if (value != ATOMIC_GET(diConf->debouncedValue)) {
+		atomic_store(&diConf->debouncedValue, value);
+		if (ATOMIC_GET(diConf->reflexMode) != 0) {
+			reflexEdge(diConf, value);
+		}
+		callDebouncedInterruptCB(diConf, value);
+	}
+}
+
+/*
+ * Samples the inputs in sampled debounce mode every period. The cost is
+ * fixed, whatever the number of edges.
+ */
+void *digitalSampler(void* arg) {
+	struct timespec next, now;
+	unsigned int period_usec, levels;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		while ((period_usec = ATOMIC_GET(digitalPeriod_usec)) != 0) {
+			checkRealtime(IONOPI_THREAD_DIGITAL);
+			levels = digitalLevels();
+			for (i = 0; i < 10; i++) {
+				if (ATOMIC_GET(diConfs[i].sampled)) {
+					digitalSample(&diConfs[i], (levels >> i) & 1, period_usec);
+				}
+			}
+
+			addMicros(&next, period_usec);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (diff_usec(&now, &next) > period_usec) {
+				// overrun, restart from now
+				next = now;
+				continue;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL) == EINTR) {
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			recordTiming(IONOPI_THREAD_DIGITAL, diff_usec(&next, &now));
+		}
+
+		atomic_store(&digitalSamplerRunning, FALSE);
+		// sampling may have been restarted before the flag was cleared
+		if (atomic_load(&digitalPeriod_usec) == 0
+				|| atomic_exchange(&digitalSamplerRunning, TRUE)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+void getStormConf(struct DigitalInputConfig* diConf, unsigned int *rate,
+		unsigned int *burst, unsigned int *summaryMillis,
+		void (**callBack)(int, int, unsigned int)) {
+	unsigned int seq;
+	do {
+		seq = seqReadBegin(&diConf->stormSeq);
+		*rate = ATOMIC_GET(diConf->stormRate);
+		*burst = ATOMIC_GET(diConf->stormBurst);
+		*summaryMillis = ATOMIC_GET(diConf->stormSummaryMillis);
+		*callBack = ATOMIC_GET(diConf->stormCallBack);
+	} while (seqReadRetry(&diConf->stormSeq, seq));
+}
+
+/*
+ * Delivers a summary of the suppressed edges every period while the storm
+ * lasts. The storm ends when the edges in a period are within the rate;
+ * the debounced state, frozen meanwhile, then follows the current level.
+ */
+void *stormSummary(void* arg) {
+	struct DigitalInputConfig* diConf = (struct DigitalInputConfig*) arg;
+	void (*callBack)(int, int, unsigned int);
+	unsigned int rate, burst, summaryMillis, suppressed;
+	struct timespec period;
+	int value;
+
+	for (;;) {
+		getStormConf(diConf, &rate, &burst, &summaryMillis, &callBack);
+		period.tv_sec = summaryMillis / 1000;
+		period.tv_nsec = (summaryMillis % 1000) * 1000000L;
+		while (nanosleep(&period, &period) == -1 && errno == EINTR) {
+		}
+
+		getStormConf(diConf, &rate, &burst, &summaryMillis, &callBack);
+		suppressed = atomic_exchange(&diConf->stormSuppressed, 0);
+		value = digitalRead(diConf->digitalInput);
+		atomic_fetch_add(&diConf->stormSummaries, 1);
+		if (callBack != NULL) {
+			callBack(diConf->digitalInput, value, suppressed);
+		}
+
+		if (rate == 0 || (uint64_t) suppressed * 1000
+				<= (uint64_t) rate * summaryMillis) {
+			atomic_store(&diConf->storming, FALSE);
+			if (ATOMIC_GET(diConf->debounceMillis) != 0) {
+				// debounce the current level as if an edge occurred
+				debounceEdge(diConf);
+			}
+
+			atomic_store(&diConf->stormThreadRunning, FALSE);
+			// a new storm may have started before the flag was cleared
+			if (!atomic_load(&diConf->storming)
+					|| atomic_exchange(&diConf->stormThreadRunning, TRUE)) {
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Token bucket limiting the edges processed on an input. Returns TRUE if
+ * the edge must be suppressed.
+ */
+int stormCheck(struct DigitalInputConfig* diConf) {
+	void (*callBack)(int, int, unsigned int);
+	unsigned int rate, burst, summaryMillis;
+	struct timespec now;
+
+	getStormConf(diConf, &rate, &burst, &summaryMillis, &callBack);
+	if (rate == 0) {
+		return FALSE;
+	}
+	if (ATOMIC_GET(diConf->storming)) {
+		atomic_fetch_add_explicit(&diConf->stormSuppressed, 1,
+				memory_order_relaxed);
+		atomic_fetch_add_explicit(&diConf->stormSuppressedTotal, 1,
+				memory_order_relaxed);
+		return TRUE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t max = (uint64_t) burst * STORM_TOKEN;
+	if (atomic_exchange(&diConf->stormReset, FALSE)) {
+		diConf->stormRefill = now;
+		diConf->stormTokens = max;
+	}
+	uint64_t elapsed_usec = diff_usec64(&diConf->stormRefill, &now);
+	diConf->stormRefill = now;
+	if (elapsed_usec >= max / rate) {
+		diConf->stormTokens = max;
+	} else {
+		diConf->stormTokens += elapsed_usec * rate;
+		if (diConf->stormTokens > max) {
+			diConf->stormTokens = max;
+		}
+	}
+
+	if (diConf->stormTokens >= STORM_TOKEN) {
+		diConf->stormTokens -= STORM_TOKEN;
+		return FALSE;
+	}
+
+	atomic_store(&diConf->stormSuppressed, 1);
+	atomic_fetch_add(&diConf->stormSuppressedTotal, 1);
+	atomic_fetch_add(&diConf->stormCount, 1);
+	atomic_store(&diConf->storming, TRUE);
+	if (!atomic_exchange(&diConf->stormThreadRunning, TRUE)) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, stormSummary, (void *) diConf);
+		if (err == 0) {
+			pthread_detach(thread);
+		} else {
+			atomic_store(&diConf->stormThreadRunning, FALSE);
+			atomic_store(&diConf->storming, FALSE);
+			fprintf(stderr, "error creating new thread [%d]\n", err);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+void digitalInterruptCB(int idx) {
+	struct DigitalInputConfig* diConf = &diConfs[idx];
+	void (*callBack)(int, int);
+	int mode, debounceMillis;
+	checkRealtime(IONOPI_THREAD_INTERRUPT);
+	if (ATOMIC_GET(diConf->sampled)) {
+		// edges handled by the sampler thread
+		if (ATOMIC_GET(diConf->triggerMode) != 0) {
+			analogCaptureEdge(diConf);
+		}
+		return;
+	}
+	if (stormCheck(diConf)) {
+		return;
+	}
+	if (ATOMIC_GET(diConf->triggerMode) != 0) {
+		analogCaptureEdge(diConf);
+	}
+	readDigitalInputConf(diConf, &callBack, &mode, &debounceMillis);
+	if (debounceMillis == 0) {
+		int reflexMode = ATOMIC_GET(diConf->reflexMode);
+		if (callBack != NULL || reflexMode != 0) {
+			struct timespec start, end;
+			int isrMode = ATOMIC_GET(diConf->isrMode);
+			int value;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (isrMode == INT_EDGE_RISING) {
+				value = HIGH;
+			} else if (isrMode == INT_EDGE_FALLING) {
+				value = LOW;
+			} else {
+				// registered for both edges, filter on the current level
+				value = digitalRead(diConf->digitalInput);
+			}
+			if (reflexMode != 0) {
+				reflexEdge(diConf, value);
+			}
+			if (callBack != NULL && (mode != INT_EDGE_RISING || value == HIGH)
+					&& (mode != INT_EDGE_FALLING || value == LOW)) {
+				dispatchInterruptCB(diConf, callBack, value);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			recordTiming(IONOPI_THREAD_INTERRUPT, diff_usec(&start, &end));
+		}
+	} else {
+		debounceEdge(diConf);
+	}
+}
+
+void di1InterruptCB() {
+	digitalInterruptCB(0);
+}
+
+void di2InterruptCB() {
+	digitalInterruptCB(1);
+}
+
+void di3InterruptCB() {
+	digitalInterruptCB(2);
+}
+
+void di4InterruptCB() {
+	digitalInterruptCB(3);
+}
+
+void di5InterruptCB() {
+	digitalInterruptCB(4);
+}
+
+void di6InterruptCB() {
+	digitalInterruptCB(5);
+}
+
+void ttl1InterruptCB() {
+	digitalInterruptCB(6);
+}
+
+void ttl2InterruptCB() {
+	digitalInterruptCB(7);
+}
+
+void ttl3InterruptCB() {
+	digitalInterruptCB(8);
+}
+
+void ttl4InterruptCB() {
+	digitalInterruptCB(9);
+}
+
+struct DigitalInputConfig diConfs[10] = {
+	{ .digitalInput = DI1, .isrCallBack = di1InterruptCB },
+	{ .digitalInput = DI2, .isrCallBack = di2InterruptCB },
+	{ .digitalInput = DI3, .isrCallBack = di3InterruptCB },
+	{ .digitalInput = DI4, .isrCallBack = di4InterruptCB },
+	{ .digitalInput = DI5, .isrCallBack = di5InterruptCB },
+	{ .digitalInput = DI6, .isrCallBack = di6InterruptCB },
+	{ .digitalInput = TTL1, .isrCallBack = ttl1InterruptCB },
+	{ .digitalInput = TTL2, .isrCallBack = ttl2InterruptCB },
+	{ .digitalInput = TTL3, .isrCallBack = ttl3InterruptCB },
+	{ .digitalInput = TTL4, .isrCallBack = ttl4InterruptCB },
+};
+
+/*
+ *
+ */
+struct DigitalInputConfig* getDigitalInputConfig(int di) {
+	switch (di) {
+	case DI1:
+		return &diConfs[0];
+	case DI2:
+		return &diConfs[1];
+	case DI3:
+		return &diConfs[2];
+	case DI4:
+		return &diConfs[3];
+	case DI5:
+		return &diConfs[4];
+	case DI6:
+		return &diConfs[5];
+	case TTL1:
+		return &diConfs[6];
+	case TTL2:
+		return &diConfs[7];
+	case TTL3:
+		return &diConfs[8];
+	case TTL4:
+		return &diConfs[9];
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Registers the interrupt for the edges needed by the current configuration.
+ * Once registered for both edges it is not registered again, since wiringPi
+ * starts a new thread on every registration.
+ */
+void digitalInputISR(struct DigitalInputConfig* diConf) {
+	void (*callBack)(int, int);
+	int mode, debounceMillis;
+	readDigitalInputConf(diConf, &callBack, &mode, &debounceMillis);
+	int reflexMode = ATOMIC_GET(diConf->reflexMode);
+	if (ATOMIC_GET(diConf->sampled)) {
+		// only the analog capture trigger needs the interrupt
+		if (ATOMIC_GET(diConf->triggerMode) == 0) {
+			return;
+		}
+		mode = INT_EDGE_BOTH;
+	} else if (debounceMillis != 0 || ATOMIC_GET(diConf->triggerMode) != 0) {
+		mode = INT_EDGE_BOTH;
+	} else if (callBack == NULL) {
+		if (reflexMode == 0) {
+			return;
+		}
+		mode = reflexMode;
+	} else if (reflexMode != 0 && reflexMode != mode) {
+		mode = INT_EDGE_BOTH;
+	}
+	int isrMode = ATOMIC_GET(diConf->isrMode);
+	if (isrMode == 0 || (isrMode != INT_EDGE_BOTH && isrMode != mode)) {
+		ATOMIC_SET(diConf->isrMode, mode);
+		wiringPiISR(diConf->digitalInput, mode, diConf->isrCallBack);
+	}
+}
+
+/*
+ *
+ */
+void ionoPiSetDigitalDebounce(int di, int millis) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL) {
+		return;
+	}
+	pinMode(di, INPUT);
+	if (millis != 0) {
+		atomic_store(&diConf->debouncedValue, digitalRead(di));
+	}
+	seqWriteBegin(&diConf->confSeq);
+	ATOMIC_SET(diConf->debounceMillis, millis);
+	seqWriteEnd(&diConf->confSeq);
+	digitalInputISR(diConf);
+}
+
+/*
+ *
+ */
+int ionoPiDigitalSampling(unsigned int periodMicros) {
+	if (periodMicros != 0 && !setupSubsystems(SETUP_GPIO)) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&setupMutex);
+	if (!gpioLevelsInit && periodMicros != 0) {
+		digitalLevelsSetup();
+	}
+	pthread_mutex_unlock(&setupMutex);
+	atomic_store(&digitalPeriod_usec, periodMicros);
+	if (periodMicros == 0 || atomic_exchange(&digitalSamplerRunning, TRUE)) {
+		return TRUE;
+	}
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, digitalSampler, NULL);
+	if (err != 0) {
+		atomic_store(&digitalSamplerRunning, FALSE);
+		return FALSE;
+	}
+	pthread_detach(thread);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiDigitalSampledDebounce(int di, unsigned int riseMillis,
+		unsigned int fallMillis) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL) {
+		return FALSE;
+	}
+	pinMode(di, INPUT);
+	seqWriteBegin(&diConf->confSeq);
+	ATOMIC_SET(diConf->sampleRiseMillis, riseMillis);
+	ATOMIC_SET(diConf->sampleFallMillis, fallMillis);
+	seqWriteEnd(&diConf->confSeq);
+	if (!atomic_load(&diConf->sampled)) {
+		// wait for a running debounce thread and keep a new one from
+		// starting, the sampler must be the only one dispatching
+		while (atomic_exchange(&diConf->debounceThreadRunning, TRUE)) {
+			usleep(1000);
+		}
+		atomic_store(&diConf->debouncedValue, digitalRead(di));
+		atomic_store(&diConf->sampleReset, TRUE);
+		atomic_store(&diConf->sampled, TRUE);
+		atomic_store(&diConf->debounceThreadRunning, FALSE);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiDigitalSampledDebounceDisable(int di) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL) {
+		return FALSE;
+	}
+	if (atomic_exchange(&diConf->sampled, FALSE)) {
+		// back to the interrupts, from the current level
+		atomic_store(&diConf->debouncedValue, digitalRead(di));
+		digitalInputISR(diConf);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiDigitalRead(int di) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL || (ATOMIC_GET(diConf->debounceMillis) == 0
+			&& !ATOMIC_GET(diConf->sampled))) {
+		return digitalRead(di);
+	} else {
+		return atomic_load_explicit(&diConf->debouncedValue,
+				memory_order_acquire);
+	}
+}
+
+/*
+ *
+ */
+int ionoPiDigitalReadIndex(int index) {
+	if (index < 0 || index >= 10) {
+		return -1;
+	}
+	struct DigitalInputConfig* diConf = &diConfs[index];
+	if (ATOMIC_GET(diConf->debounceMillis) == 0
+			&& !ATOMIC_GET(diConf->sampled)) {
+		return digitalRead(diConf->digitalInput);
+	} else {
+		return atomic_load_explicit(&diConf->debouncedValue,
+				memory_order_acquire);
+	}
+}
+
+/*
+ *
+ */
+int ionoPiDigitalInterrupt(int di, int mode, void (*callBack)(int, int)) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL) {
+		return FALSE;
+	}
+	seqWriteBegin(&diConf->confSeq);
+	ATOMIC_SET(diConf->callBack, callBack);
+	ATOMIC_SET(diConf->callBackMode, mode);
+	seqWriteEnd(&diConf->confSeq);
+	digitalInputISR(diConf);
+
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiDigitalStormProtection(int di, unsigned int rate, unsigned int burst,
+		unsigned int summaryMillis,
+		void (*callBack)(int, int, unsigned int)) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL || (rate > 0 && burst == 0)) {
+		return FALSE;
+	}
+	seqWriteBegin(&diConf->stormSeq);
+	ATOMIC_SET(diConf->stormRate, rate);
+	ATOMIC_SET(diConf->stormBurst, burst);
+	ATOMIC_SET(diConf->stormSummaryMillis,
+			summaryMillis > 0 ? summaryMillis : STORM_SUMMARY_MILLIS);
+	ATOMIC_SET(diConf->stormCallBack, callBack);
+	seqWriteEnd(&diConf->stormSeq);
+	// full bucket from now on the next edge
+	atomic_store(&diConf->stormReset, TRUE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetStormStats(int di, struct IonoPiStormStats* stats, int reset) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL || stats == NULL) {
+		return FALSE;
+	}
+	stats->active = ATOMIC_GET(diConf->storming);
+	stats->storms = ATOMIC_GET(diConf->stormCount);
+	stats->suppressed = ATOMIC_GET(diConf->stormSuppressedTotal);
+	stats->summaries = ATOMIC_GET(diConf->stormSummaries);
+	if (reset) {
+		ATOMIC_SET(diConf->stormCount, 0);
+		ATOMIC_SET(diConf->stormSuppressedTotal, 0);
+		ATOMIC_SET(diConf->stormSummaries, 0);
+	}
+	return TRUE;
+}
+
+/*
+ * Reflex rules, compiled in a table where the rules of each input are
+ * listed contiguously. The table is swapped atomically; the dispatch path
+ * only increments a counter while using it, and the previous table is freed
+ * once the counter drops to zero.
+ */
+struct ReflexRule {
+	int edge;
+	int output;
+	int action;
+	int value;
+	unsigned int delayMillis;
+	unsigned int pulseMillis;
+	atomic_ulong hits;
+	atomic_ulong dropped;
+};
+
+struct ReflexTable {
+	unsigned int generation;
+	int count;
+	/* rules of input i: byInput[first[i]] to byInput[first[i + 1] - 1] */
+	int first[11];
+	int byInput[REFLEX_RULES_MAX];
+	struct ReflexRule rules[REFLEX_RULES_MAX];
+};
+
+_Atomic(struct ReflexTable*) reflexTable = NULL;
+atomic_int reflexReaders = 0;
+unsigned int reflexGeneration = 0;
+
+/*
+ * Delayed writes, executed by the reflex thread. value is -1 to toggle.
+ */
+struct ReflexAction {
+	struct timespec at;
+	int output;
+	int value;
+	unsigned int generation;
+	int rule;
+} reflexPending[REFLEX_PENDING_MAX];
+
+int reflexPendingCount = 0;
+int reflexThreadStarted = FALSE;
+pthread_mutex_t reflexMutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes ionoPiReflexRules(), held while waiting for the readers */
+pthread_mutex_t reflexInstallMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reflexCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ *
+ */
+void reflexWrite(int output, int value) {
+	if (value < 0) {
+		value = digitalRead(output) == HIGH ? LOW : HIGH;
+	}
+	digitalWrite(output, value);
+}
+
+/*
+ * Executes the pending actions when due.
+ */
+void *reflexThread(void* arg) {
+	struct timespec now, next;
+	int i, first, output, value;
+
+	pthread_mutex_lock(&reflexMutex);
+	for (;;) {
+		if (reflexPendingCount == 0) {
+			pthread_cond_wait(&reflexCond, &reflexMutex);
+			continue;
+		}
+		first = 0;
+		for (i = 1; i < reflexPendingCount; i++) {
+			if (timeBefore(&reflexPending[i].at, &reflexPending[first].at)) {
+				first = i;
+			}
+		}
+		next = reflexPending[first].at;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timeBefore(&now, &next)) {
+			pthread_cond_clockwait(&reflexCond, &reflexMutex, CLOCK_MONOTONIC,
+					&next);
+			continue;
+		}
+		output = reflexPending[first].output;
+		value = reflexPending[first].value;
+		reflexPending[first] = reflexPending[--reflexPendingCount];
+		pthread_mutex_unlock(&reflexMutex);
+
+		checkRealtime(IONOPI_THREAD_REFLEX);
+		reflexWrite(output, value);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		recordTiming(IONOPI_THREAD_REFLEX, diff_usec(&next, &now));
+
+		pthread_mutex_lock(&reflexMutex);
+	}
+	return NULL;
+}
+
+/*
+ * Replaces the pending actions of a rule, so that a new edge restarts its
+ * delay or pulse. Returns FALSE if there is no room.
+ */
+int reflexSchedule(struct ReflexTable* t, int rule, struct timespec* now,
+		int immediate) {
+	struct ReflexRule* r = &t->rules[rule];
+	struct ReflexAction* a;
+	int i, needed;
+
+	needed = (r->delayMillis > 0) + (r->action == IONOPI_REFLEX_PULSE);
+	pthread_mutex_lock(&reflexMutex);
+	for (i = 0; i < reflexPendingCount;) {
+		if (reflexPending[i].generation == t->generation
+				&& reflexPending[i].rule == rule) {
+			reflexPending[i] = reflexPending[--reflexPendingCount];
+		} else {
+			i++;
+		}
+	}
+	if (reflexPendingCount + needed > REFLEX_PENDING_MAX) {
+		pthread_mutex_unlock(&reflexMutex);
+		return FALSE;
+	}
+	if (!immediate) {
+		a = &reflexPending[reflexPendingCount++];
+		a->at = *now;
+		addMillis(&a->at, r->delayMillis);
+		a->output = r->output;
+		a->value = r->action == IONOPI_REFLEX_TOGGLE ? -1 : r->value;
+		a->generation = t->generation;
+		a->rule = rule;
+	}
+	if (r->action == IONOPI_REFLEX_PULSE) {
+		a = &reflexPending[reflexPendingCount++];
+		a->at = *now;
+		addMillis(&a->at, (uint64_t) r->delayMillis + r->pulseMillis);
+		a->output = r->output;
+		a->value = r->value == HIGH ? LOW : HIGH;
+		a->generation = t->generation;
+		a->rule = rule;
+	}
+	pthread_cond_signal(&reflexCond);
+	pthread_mutex_unlock(&reflexMutex);
+	return TRUE;
+}
+
+/*
+ * Runs the rules of an input on an edge, called by the interrupt or debounce
+ * thread before the callback.
+ */
+void reflexEdge(struct DigitalInputConfig* diConf, int value) {
+	struct ReflexTable* t;
+	struct ReflexRule* r;
+	struct timespec now;
+	int idx = diConf - diConfs;
+	int i, rule, immediate;
+
+	atomic_fetch_add(&reflexReaders, 1);
+	t = atomic_load(&reflexTable);
+	if (t != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = t->first[idx]; i < t->first[idx + 1]; i++) {
+			rule = t->byInput[i];
+			r = &t->rules[rule];
+			if ((r->edge == INT_EDGE_RISING && value != HIGH)
+					|| (r->edge == INT_EDGE_FALLING && value != LOW)) {
+				continue;
+			}
+			atomic_fetch_add_explicit(&r->hits, 1, memory_order_relaxed);
+			immediate = r->delayMillis == 0;
+			if (immediate) {
+				reflexWrite(r->output,
+						r->action == IONOPI_REFLEX_TOGGLE ? -1 : r->value);
+			}
+			if ((!immediate || r->action == IONOPI_REFLEX_PULSE)
+					&& !reflexSchedule(t, rule, &now, immediate)) {
+				atomic_fetch_add_explicit(&r->dropped, 1,
+						memory_order_relaxed);
+			}
+		}
+	}
+	atomic_fetch_sub(&reflexReaders, 1);
+}
+
+/*
+ *
+ */
+int isReflexOutput(int output) {
+	return output == O1 || output == O2 || output == O3 || output == O4
+			|| output == OC1 || output == OC2 || output == OC3
+			|| output == LED;
+}
+
+/*
+ *
+ */
+int ionoPiReflexRules(const struct IonoPiReflexRule* rules, int count) {
+	struct ReflexTable* t = NULL;
+	struct ReflexTable* old;
+	int modes[10] = { 0 };
+	int i, j, idx, n;
+
+	if (count < 0 || count > REFLEX_RULES_MAX || (count > 0 && rules == NULL)) {
+		return FALSE;
+	}
+	for (i = 0; i < count; i++) {
+		const struct IonoPiReflexRule* r = &rules[i];
+		if (getDigitalInputConfig(r->input) == NULL
+				|| (r->edge != INT_EDGE_RISING && r->edge != INT_EDGE_FALLING
+						&& r->edge != INT_EDGE_BOTH)
+				|| !isReflexOutput(r->output)
+				|| (r->action != IONOPI_REFLEX_SET
+						&& r->action != IONOPI_REFLEX_PULSE
+						&& r->action != IONOPI_REFLEX_TOGGLE)
+				|| (r->action == IONOPI_REFLEX_PULSE && r->pulseMillis == 0)) {
+			return FALSE;
+		}
+	}
+
+	pthread_mutex_lock(&reflexInstallMutex);
+	pthread_mutex_lock(&reflexMutex);
+	if (count > 0 && !reflexThreadStarted) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, reflexThread, NULL) != 0) {
+			pthread_mutex_unlock(&reflexMutex);
+			pthread_mutex_unlock(&reflexInstallMutex);
+			return FALSE;
+		}
+		pthread_detach(thread);
+		reflexThreadStarted = TRUE;
+	}
+	pthread_mutex_unlock(&reflexMutex);
+
+	if (count > 0) {
+		t = calloc(1, sizeof(struct ReflexTable));
+		if (t == NULL) {
+			pthread_mutex_unlock(&reflexInstallMutex);
+			return FALSE;
+		}
+		t->count = count;
+		for (i = 0; i < count; i++) {
+			struct ReflexRule* r = &t->rules[i];
+			r->edge = rules[i].edge;
+			r->output = rules[i].output;
+			r->action = rules[i].action;
+			r->value = rules[i].value ? HIGH : LOW;
+			r->delayMillis = rules[i].delayMillis;
+			r->pulseMillis = rules[i].pulseMillis;
+		}
+		n = 0;
+		for (idx = 0; idx < 10; idx++) {
+			t->first[idx] = n;
+			for (i = 0; i < count; i++) {
+				if (getDigitalInputConfig(rules[i].input) == &diConfs[idx]) {
+					t->byInput[n++] = i;
+					modes[idx] = modes[idx] == 0 || modes[idx] == rules[i].edge ?
+							rules[i].edge : INT_EDGE_BOTH;
+				}
+			}
+		}
+		t->first[10] = n;
+	}
+
+	pthread_mutex_lock(&reflexMutex);
+	if (t != NULL) {
+		t->generation = ++reflexGeneration;
+	}
+	old = atomic_exchange(&reflexTable, t);
+	pthread_mutex_unlock(&reflexMutex);
+
+	for (j = 0; j < 10; j++) {
+		ATOMIC_SET(diConfs[j].reflexMode, modes[j]);
+		digitalInputISR(&diConfs[j]);
+	}
+
+	// the dispatch path may still be using the previous table
+	while (atomic_load(&reflexReaders) != 0) {
+		usleep(100);
+	}
+	free(old);
+	pthread_mutex_unlock(&reflexInstallMutex);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetReflexStats(int rule, struct IonoPiReflexStats* stats,
+		int reset) {
+	struct ReflexTable* t;
+	int ok = FALSE;
+	if (stats == NULL) {
+		return FALSE;
+	}
+	atomic_fetch_add(&reflexReaders, 1);
+	t = atomic_load(&reflexTable);
+	if (t != NULL && rule >= 0 && rule < t->count) {
+		struct ReflexRule* r = &t->rules[rule];
+		if (reset) {
+			stats->hits = atomic_exchange(&r->hits, 0);
+			stats->dropped = atomic_exchange(&r->dropped, 0);
+		} else {
+			stats->hits = atomic_load(&r->hits);
+			stats->dropped = atomic_load(&r->dropped);
+		}
+		ok = TRUE;
+	}
+	atomic_fetch_sub(&reflexReaders, 1);
+	return ok;
+}
+
+/*
+ *
+ */
+int ionoPiCallbackWorkers(int workers, unsigned int queueSize, int policy) {
+	pthread_t* threads;
+	int i, started;
+	if (policy != IONOPI_CALLBACK_DROP_OLDEST
+			&& policy != IONOPI_CALLBACK_COALESCE
+			&& policy != IONOPI_CALLBACK_BLOCK) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&cbMutex);
+	if (ATOMIC_GET(cbWorkers) > 0) {
+		// only the policy can be changed once started
+		int ok = workers == ATOMIC_GET(cbWorkers) && queueSize == cbQueueSize;
+		if (ok) {
+			ATOMIC_SET(cbPolicy, policy);
+		}
+		pthread_mutex_unlock(&cbMutex);
+		return ok;
+	}
+	if (workers < 1 || queueSize < 1 || queueSize > CALLBACK_QUEUE_SIZE_MAX) {
+		pthread_mutex_unlock(&cbMutex);
+		return FALSE;
+	}
+
+	threads = malloc(workers * sizeof(pthread_t));
+	if (threads == NULL) {
+		pthread_mutex_unlock(&cbMutex);
+		return FALSE;
+	}
+	for (i = 0; i < 10; i++) {
+		cbQueues[i].events = calloc(queueSize, sizeof(atomic_ullong));
+		if (cbQueues[i].events == NULL) {
+			break;
+		}
+	}
+	if (i < 10 || sem_init(&cbReadySem, 0, 0) != 0) {
+		while (i-- > 0) {
+			free(cbQueues[i].events);
+			cbQueues[i].events = NULL;
+		}
+		free(threads);
+		pthread_mutex_unlock(&cbMutex);
+		return FALSE;
+	}
+	for (i = 0; i < CALLBACK_READY_SIZE; i++) {
+		atomic_init(&cbReady[i].seq, i);
+	}
+	cbQueueSize = queueSize;
+	ATOMIC_SET(cbPolicy, policy);
+
+	for (started = 0; started < workers; started++) {
+		if (pthread_create(&threads[started], NULL, callbackWorker, NULL)
+				!= 0) {
+			break;
+		}
+	}
+	if (started < workers) {
+		// stop the started workers, events are still dispatched directly
+		for (i = 0; i < started; i++) {
+			callbackReadyPush(CALLBACK_WORKER_EXIT);
+		}
+		for (i = 0; i < started; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		sem_destroy(&cbReadySem);
+		for (i = 0; i < 10; i++) {
+			free(cbQueues[i].events);
+			cbQueues[i].events = NULL;
+		}
+		free(threads);
+		pthread_mutex_unlock(&cbMutex);
+		return FALSE;
+	}
+	for (i = 0; i < workers; i++) {
+		pthread_detach(threads[i]);
+	}
+	free(threads);
+	atomic_store_explicit(&cbWorkers, workers, memory_order_release);
+	pthread_mutex_unlock(&cbMutex);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetCallbackStats(int di, struct IonoPiCallbackStats* stats,
+		int reset) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL || stats == NULL) {
+		return FALSE;
+	}
+	struct CallbackQueue* q = &cbQueues[diConf - diConfs];
+	stats->queued = ATOMIC_GET(q->queued);
+	stats->delivered = ATOMIC_GET(q->delivered);
+	stats->dropped = ATOMIC_GET(q->dropped);
+	stats->coalesced = ATOMIC_GET(q->coalesced);
+	stats->blocked = ATOMIC_GET(q->blocked);
+	stats->maxDepth = ATOMIC_GET(q->maxDepth);
+	if (reset) {
+		ATOMIC_SET(q->queued, 0);
+		ATOMIC_SET(q->delivered, 0);
+		ATOMIC_SET(q->dropped, 0);
+		ATOMIC_SET(q->coalesced, 0);
+		ATOMIC_SET(q->blocked, 0);
+		ATOMIC_SET(q->maxDepth, 0);
+	}
+	return TRUE;
+}
+
+/*
+ * Converts the channels in the given mask with a single SPI transfer at the
+ * given clock speed, setting values[channel].
+ */
+int adcTransfer(unsigned int mask, int* values, int hz) {
+	/*
+	 * See http://ww1.microchip.com/downloads/en/DeviceDoc/21298c.pdf Page 18
+	 *
+	 * 1st byte: 0 0 0 0 0 1 SGL/DIFF D2 = 0 0 0 0 0 1 1 0
+	 *
+	 * 2nd byte: D1 D0 X X X X X X
+	 *
+	 * 3rd byte: X X X X X X X X
+	 *
+	 */
+	unsigned char data[MCP_CHANNELS][3];
+	struct spi_ioc_transfer tr[MCP_CHANNELS];
+	int ch, n = 0;
+
+	// transfer done here to set the clock speed, which wiringPi
+	// fixes at setup
+	memset(tr, 0, sizeof(tr));
+	for (ch = 0; ch < MCP_CHANNELS; ch++) {
+		if (mask & (1 << ch)) {
+			data[n][0] = 0b110;
+			data[n][1] = ch << 6;
+			data[n][2] = 0;
+			tr[n].tx_buf = (unsigned long) data[n];
+			tr[n].rx_buf = (unsigned long) data[n];
+			tr[n].len = 3;
+			tr[n].speed_hz = hz;
+			tr[n].bits_per_word = 8;
+			// each conversion starts with a falling edge of CS
+			tr[n].cs_change = 1;
+			n++;
+		}
+	}
+	if (n == 0) {
+		return FALSE;
+	}
+	tr[n - 1].cs_change = 0;
+
+	if (ioctl(wiringPiSPIGetFd(MCP_SPI_CHANNEL), SPI_IOC_MESSAGE(n), tr) < 0) {
+		return FALSE;
+	}
+
+	n = 0;
+	for (ch = 0; ch < MCP_CHANNELS; ch++) {
+		if (mask & (1 << ch)) {
+			values[ch] = ((data[n][1] & 0x0F) << 8) + (data[n][2] & 0xFF);
+			n++;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Returns TRUE if a conversion started at ts can serve a request made at
+ * the given time, i.e. if it started after it or less than maxAge_usec
+ * before it.
+ */
+int adcFresh(struct timespec* ts, struct timespec* request,
+		unsigned int maxAge_usec) {
+	return !timeBefore(ts, request) || diff_usec(ts, request) < maxAge_usec;
+}
+
+/*
+ * Reads the channels in the given mask, setting values[channel]. The values
+ * converted less than maxAge_usec before the call are returned from the
+ * last conversion; the others are added to the pending conversions, or
+ * taken from the in-flight transfer if fresh enough. Must be called with
+ * adcMutex held.
+ */
+int adcRequest(unsigned int mask, int* values, unsigned int maxAge_usec) {
+	struct timespec start, now, ts[MCP_CHANNELS];
+	unsigned int target[MCP_CHANNELS];
+	unsigned int need = 0, batch, n;
+	int converted[MCP_CHANNELS];
+	int ch, ok, waited;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (ch = 0; ch < MCP_CHANNELS; ch++) {
+		struct AdcChannel* c = &adcChannels[ch];
+		if (!(mask & (1 << ch))) {
+			continue;
+		}
+		adcStats.requests++;
+		if (c->gen != 0 && c->value >= 0
+				&& adcFresh(&c->ts, &start, maxAge_usec)) {
+			adcStats.cached++;
+			values[ch] = c->value;
+			ts[ch] = c->ts;
+			continue;
+		}
+		need |= 1 << ch;
+		if ((adcInflight & (1 << ch))
+				&& adcFresh(&adcInflightTs, &start, maxAge_usec)) {
+			target[ch] = c->gen + 1;
+			c->inflightRequests++;
+		} else {
+			// after the in-flight conversion, if any, and the next one
+			target[ch] = c->gen + ((adcInflight & (1 << ch)) ? 2 : 1);
+			adcPending |= 1 << ch;
+			c->pendingRequests++;
+		}
+	}
+
+	waited = need != 0;
+	if (waited) {
+		adcQueue++;
+		if (adcQueue > adcStats.maxQueue) {
+			adcStats.maxQueue = adcQueue;
+		}
+		for (;;) {
+			for (ch = 0; ch < MCP_CHANNELS; ch++) {
+				if ((need & (1 << ch))
+						&& (int) (adcChannels[ch].gen - target[ch]) >= 0) {
+					values[ch] = adcChannels[ch].value;
+					ts[ch] = adcChannels[ch].ts;
+					need &= ~(1 << ch);
+				}
+			}
+			if (need == 0) {
+				break;
+			}
+			if (adcBusy) {
+				pthread_cond_wait(&adcCond, &adcMutex);
+				continue;
+			}
+
+			// bus free and our conversions still pending: take them all
+			batch = adcPending;
+			adcPending = 0;
+			adcInflight = batch;
+			adcBusy = TRUE;
+			for (ch = 0; ch < MCP_CHANNELS; ch++) {
+				adcChannels[ch].inflightRequests =
+						adcChannels[ch].pendingRequests;
+				adcChannels[ch].pendingRequests = 0;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &adcInflightTs);
+
+			pthread_mutex_unlock(&adcMutex);
+			ok = adcTransfer(batch, converted, ATOMIC_GET(mcpSpiSpeed));
+			pthread_mutex_lock(&adcMutex);
+
+			n = 0;
+			for (ch = 0; ch < MCP_CHANNELS; ch++) {
+				struct AdcChannel* c = &adcChannels[ch];
+				if (!(batch & (1 << ch))) {
+					continue;
+				}
+				c->value = ok ? converted[ch] : -1;
+				c->ts = adcInflightTs;
+				c->gen++;
+				if (c->inflightRequests > 1) {
+					adcStats.merged += c->inflightRequests - 1;
+				}
+				c->inflightRequests = 0;
+				n++;
+			}
+			adcStats.transfers++;
+			adcStats.conversions += n;
+			if (!ok) {
+				adcStats.errors++;
+			}
+			if (n > adcStats.maxBatch) {
+				adcStats.maxBatch = n;
+			}
+			adcInflight = 0;
+			adcBusy = FALSE;
+			pthread_cond_broadcast(&adcCond);
+		}
+		adcQueue--;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (waited) {
+		unsigned long int wait_usec = diff_usec(&start, &now);
+		adcStats.waits++;
+		adcStats.sumWait_usec += wait_usec;
+		if (wait_usec > adcStats.maxWait_usec) {
+			adcStats.maxWait_usec = wait_usec;
+		}
+	}
+	ok = TRUE;
+	for (ch = 0; ch < MCP_CHANNELS; ch++) {
+		if (!(mask & (1 << ch))) {
+			continue;
+		}
+		if (values[ch] < 0) {
+			ok = FALSE;
+			continue;
+		}
+		unsigned long int age_usec = diff_usec(&ts[ch], &now);
+		adcStats.ages++;
+		adcStats.sumAge_usec += age_usec;
+		if (age_usec > adcStats.maxAge_usec) {
+			adcStats.maxAge_usec = age_usec;
+		}
+	}
+	return ok;
+}
+
+/*
+ * Reads the channels in the given mask, setting values[channel], accepting
+ * values converted less than maxAge_usec before the call.
+ */
+int adcRead(unsigned int mask, int* values, unsigned int maxAge_usec) {
+	int ok;
+
+	if (!setupSubsystems(IONOPI_SETUP_ANALOG)) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&adcMutex);
+	ok = adcRequest(mask, values, maxAge_usec);
+	pthread_mutex_unlock(&adcMutex);
+	return ok;
+}
+
+/*
+ * Converts the channels in the given mask at the given clock speed, setting
+ * values[channel]. The bus is taken exclusively: other requests are neither
+ * merged in the transfer nor served with its values.
+ */
+int adcReadAt(unsigned int mask, int* values, int hz) {
+	int ok;
+
+	if (!setupSubsystems(IONOPI_SETUP_ANALOG)) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&adcMutex);
+	while (adcBusy) {
+		pthread_cond_wait(&adcCond, &adcMutex);
+	}
+	adcBusy = TRUE;
+	pthread_mutex_unlock(&adcMutex);
+
+	ok = adcTransfer(mask, values, hz);
+
+	pthread_mutex_lock(&adcMutex);
+	adcStats.transfers++;
+	if (!ok) {
+		adcStats.errors++;
+	}
+	adcBusy = FALSE;
+	pthread_cond_broadcast(&adcCond);
+	pthread_mutex_unlock(&adcMutex);
+	return ok;
+}
+
+/*
+ * Returns the MCP3204 channel of the given analog input, or -1.
+ */
+int adcChannel(int ai) {
+	if ((ai & ~0xC0) != 0) {
+		return -1;
+	}
+	return ai >> 6;
+}
+
+/*
+ *
+ */
+int mcp3204Read(unsigned char channel) {
+	int values[MCP_CHANNELS];
+	int ch = adcChannel(channel);
+
+	if (ch < 0 || !adcRead(1 << ch, values, ATOMIC_GET(adcFreshness_usec))) {
+		return -1;
+	}
+	return values[ch];
+}
+
+/*
+ *
+ */
+int ionoPiAnalogRead(int ai) {
+	int v = mcp3204Read(ai);
+	if (v < 0) {
+		return -1;
+	}
+	return v;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogReadMany(const int* ais, int count, int* values) {
+	int raw[MCP_CHANNELS];
+	unsigned int mask = 0;
+	int i, ch;
+
+	if (ais == NULL || values == NULL || count <= 0) {
+		return FALSE;
+	}
+	for (i = 0; i < count; i++) {
+		ch = adcChannel(ais[i]);
+		if (ch < 0) {
+			return FALSE;
+		}
+		mask |= 1 << ch;
+	}
+	if (!adcRead(mask, raw, ATOMIC_GET(adcFreshness_usec))) {
+		return FALSE;
+	}
+	for (i = 0; i < count; i++) {
+		values[i] = raw[adcChannel(ais[i])];
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+float ionoPiVoltageRead(int ai) {
+	int v = mcp3204Read(ai);
+	if (v < 0) {
+		return -1;
+	}
+
+	return ionoPiRawToVoltage(ai, v);
+}
+
+/*
+ *
+ */
+float ionoPiRawToVoltage(int ai, int value) {
+	float factor;
+	if (ai == AI1 || ai == AI2) {
+		factor = AI1_AI2_FACTOR;
+	} else {
 		factor = AI3_AI4_FACTOR;
 	}
-
-	return factor * v;
+
+	return factor * value;
+}
+
+/*
+ *
+ */
+int ionoPiSetAnalogSpeed(int hz) {
+	if (hz < MCP_SPI_SPEED_MIN || hz > MCP_SPI_SPEED_MAX) {
+		return FALSE;
+	}
+	atomic_store(&mcpSpiSpeed, hz);
+	atomic_store(&mcpSpiSpeedSet, TRUE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetAnalogSpeed() {
+	return atomic_load(&mcpSpiSpeed);
+}
+
+/*
+ *
+ */
+void ionoPiSetAnalogFreshness(unsigned int maxAgeMicros) {
+	ATOMIC_SET(adcFreshness_usec, maxAgeMicros);
+}
+
+/*
+ *
+ */
+int ionoPiGetAnalogBusStats(struct IonoPiAnalogBusStats* stats, int reset) {
+	if (stats == NULL) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&adcMutex);
+	stats->requests = adcStats.requests;
+	stats->cached = adcStats.cached;
+	stats->merged = adcStats.merged;
+	stats->conversions = adcStats.conversions;
+	stats->transfers = adcStats.transfers;
+	stats->errors = adcStats.errors;
+	stats->maxBatch = adcStats.maxBatch;
+	stats->maxQueue = adcStats.maxQueue;
+	stats->meanWaitMicros = adcStats.waits > 0 ?
+			adcStats.sumWait_usec / adcStats.waits : 0;
+	stats->maxWaitMicros = adcStats.maxWait_usec;
+	stats->meanAgeMicros = adcStats.ages > 0 ?
+			adcStats.sumAge_usec / adcStats.ages : 0;
+	stats->maxAgeMicros = adcStats.maxAge_usec;
+	if (reset) {
+		memset(&adcStats, 0, sizeof(adcStats));
+	}
+	pthread_mutex_unlock(&adcMutex);
+	return TRUE;
+}
+
+/*
+ * Reads CALIBRATION_SAMPLES samples of each analog input at the given
+ * speed, returning their means and the maximum deviation from the mean.
+ */
+int calibrationRead(int hz, float *means, int *spreads) {
+	static const int ais[] = { AI1, AI2, AI3, AI4 };
+	int values[4][CALIBRATION_SAMPLES];
+	int raw[MCP_CHANNELS];
+	int i, c;
+
+	for (i = 0; i < CALIBRATION_SAMPLES; i++) {
+		// the other readers keep using the current speed
+		if (!adcReadAt((1 << MCP_CHANNELS) - 1, raw, hz)) {
+			return FALSE;
+		}
+		for (c = 0; c < 4; c++) {
+			values[c][i] = raw[adcChannel(ais[c])];
+		}
+	}
+
+	for (c = 0; c < 4; c++) {
+		long int sum = 0;
+		for (i = 0; i < CALIBRATION_SAMPLES; i++) {
+			sum += values[c][i];
+		}
+		means[c] = (float) sum / CALIBRATION_SAMPLES;
+		spreads[c] = 0;
+		for (i = 0; i < CALIBRATION_SAMPLES; i++) {
+			int d = abs((int) (values[c][i] - means[c] + 0.5f));
+			if (d > spreads[c]) {
+				spreads[c] = d;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Tries increasing clock speeds, comparing the readings with those taken
+ * right before and after at the default speed, and stops at the first
+ * speed giving different means or noisier readings.
+ */
+int ionoPiAnalogCalibrateSpeed(int save) {
+	static const int speeds[] = { 100000, 200000, 500000, 1000000, 1350000,
+			2000000 };
+	float refMeans[4], refMeans2[4], means[4];
+	int refSpreads[4], refSpreads2[4], spreads[4];
+	int i, c, best = MCP_SPI_SPEED;
+
+	if (!setupSubsystems(IONOPI_SETUP_ANALOG)) {
+		return -1;
+	}
+
+	for (i = 0; i < (int) (sizeof(speeds) / sizeof(speeds[0])); i++) {
+		if (!calibrationRead(MCP_SPI_SPEED, refMeans, refSpreads)
+				|| !calibrationRead(speeds[i], means, spreads)
+				|| !calibrationRead(MCP_SPI_SPEED, refMeans2, refSpreads2)) {
+			return -1;
+		}
+		int ok = TRUE;
+		for (c = 0; c < 4 && ok; c++) {
+			float refMean = (refMeans[c] + refMeans2[c]) / 2;
+			int refSpread = refSpreads[c] > refSpreads2[c] ?
+					refSpreads[c] : refSpreads2[c];
+			float drift = refMeans[c] > refMeans2[c] ?
+					refMeans[c] - refMeans2[c] : refMeans2[c] - refMeans[c];
+			float diff = means[c] > refMean ?
+					means[c] - refMean : refMean - means[c];
+			if (diff > drift / 2 + CALIBRATION_TOLERANCE
+					|| spreads[c] > 2 * refSpread + CALIBRATION_TOLERANCE) {
+				ok = FALSE;
+			}
+		}
+		if (!ok) {
+			break;
+		}
+		best = speeds[i];
+	}
+
+	atomic_store(&mcpSpiSpeed, best);
+	atomic_store(&mcpSpiSpeedSet, TRUE);
+
+	if (save) {
+		mkdir(MCP_SPI_SPEED_DIR, 0755);
+		FILE *fp = fopen(MCP_SPI_SPEED_FILE, "w");
+		if (fp == NULL) {
+			return -1;
+		}
+		fprintf(fp, "%d\n", best);
+		if (fclose(fp) != 0) {
+			return -1;
+		}
+	}
+
+	return best;
+}
+
+/*
+ *
+ */
+struct AnalogInputConfig* getAnalogInputConfig(int ai) {
+	switch (ai) {
+	case AI1:
+		return &aiConfs[0];
+	case AI2:
+		return &aiConfs[1];
+	case AI3:
+		return &aiConfs[2];
+	case AI4:
+		return &aiConfs[3];
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *
+ */
+int voltageToRaw(int ai, float voltage) {
+	float raw = voltage / ionoPiRawToVoltage(ai, 1);
+	if (raw < 0) {
+		return 0;
+	}
+	if (raw > 4095) {
+		return 4095;
+	}
+	return (int) (raw + 0.5f);
+}
+
+/*
+ * Returns TRUE if any feature needs samples of the given analog input.
+ */
+int analogInputActive(struct AnalogInputConfig* aiConf) {
+	return ATOMIC_GET(aiConf->cmpEnabled)
+			|| ATOMIC_GET(aiConf->captureEnabled)
+			|| ATOMIC_GET(statsAnalogEnabled[aiConf - aiConfs]);
+}
+
+/*
+ *
+ */
+void analogComparator(struct AnalogInputConfig* aiConf, int raw,
+		struct timespec* ts) {
+	void (*callBack)(int, int, float);
+	int low, high, dwellMillis;
+	unsigned int seq;
+	do {
+		seq = seqReadBegin(&aiConf->cmpSeq);
+		low = ATOMIC_GET(aiConf->cmpLow);
+		high = ATOMIC_GET(aiConf->cmpHigh);
+		dwellMillis = ATOMIC_GET(aiConf->cmpDwellMillis);
+		callBack = ATOMIC_GET(aiConf->cmpCallBack);
+	} while (seqReadRetry(&aiConf->cmpSeq, seq));
+
+	int state = ATOMIC_GET(aiConf->cmpState);
+	if (state < 0) {
+		ATOMIC_SET(aiConf->cmpState, raw >= high ? HIGH : LOW);
+		aiConf->cmpPending = FALSE;
+		return;
+	}
+
+	if ((state == LOW && raw < high) || (state == HIGH && raw > low)) {
+		aiConf->cmpPending = FALSE;
+		return;
+	}
+
+	if (!aiConf->cmpPending) {
+		aiConf->cmpPending = TRUE;
+		aiConf->cmpPendingSince = *ts;
+	}
+	if (diff_usec(&aiConf->cmpPendingSince, ts) < dwellMillis * 1000UL) {
+		return;
+	}
+
+	aiConf->cmpPending = FALSE;
+	state = (state == LOW) ? HIGH : LOW;
+	atomic_store(&aiConf->cmpState, state);
+
+	int fd = ATOMIC_GET(analogEventFd);
+	if (fd >= 0) {
+		eventfd_write(fd, 1);
+	}
+	if (callBack != NULL) {
+		callBack(aiConf->analogInput, state,
+				ionoPiRawToVoltage(aiConf->analogInput, raw));
+	}
+}
+
+/*
+ * Called by the sampler thread for every sample.
+ */
+void analogSample(struct AnalogInputConfig* aiConf, int raw,
+		struct timespec* ts) {
+	if (ATOMIC_GET(aiConf->cmpEnabled)) {
+		analogComparator(aiConf, raw, ts);
+	}
+	if (ATOMIC_GET(aiConf->captureEnabled)) {
+		aiConf->lastRaw = raw;
+	}
+	if (ATOMIC_GET(statsAnalogEnabled[aiConf - aiConfs])) {
+		statsAnalogAdd(aiConf - aiConfs, raw);
+	}
+}
+
+/*
+ * Triggered capture. The sampler writes each row of samples in the ring of
+ * the recording block, twice, at positions i and i + size, so that the last
+ * size rows are always contiguous and the block can be handed over as is.
+ * On a trigger another block is reserved for the following recording, and
+ * the current one is handed over after the post-trigger rows. All the
+ * capture state is protected by captureMutex, only held for a few
+ * operations per row.
+ */
+struct AnalogCaptureBlock {
+	struct IonoPiAnalogCapture cap;
+	unsigned int generation;
+	struct AnalogCaptureBlock* next;
+	uint64_t* ts;
+	int* values;
+};
+
+struct AnalogCapture {
+	unsigned int generation;
+	int count;
+	int ais[4];
+	struct AnalogInputConfig* aiConfs[4];
+	unsigned int pre;
+	unsigned int post;
+	unsigned int size;
+
+	struct AnalogCaptureBlock* free;
+	struct AnalogCaptureBlock* readyHead;
+	struct AnalogCaptureBlock* readyTail;
+
+	/* recording */
+	struct AnalogCaptureBlock* cur;
+	struct AnalogCaptureBlock* reserved;
+	uint64_t rows;
+	uint64_t triggerRow;
+	unsigned int remaining;
+	int triggered;
+	int pendingTrigger;
+	int pendingSource;
+	int pendingValue;
+	uint64_t pendingMicros;
+	unsigned long int dropped;
+} *analogCapture = NULL;
+
+atomic_int analogCaptureEnabled = FALSE;
+unsigned int analogCaptureGeneration = 0;
+pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t captureCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ *
+ */
+struct AnalogCaptureBlock* captureBlockAlloc(struct AnalogCapture* c) {
+	struct AnalogCaptureBlock* b = calloc(1,
+			sizeof(struct AnalogCaptureBlock));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->ts = malloc(2 * c->size * sizeof(uint64_t));
+	b->values = malloc(2 * c->size * c->count * sizeof(int));
+	if (b->ts == NULL || b->values == NULL) {
+		free(b->ts);
+		free(b->values);
+		free(b);
+		return NULL;
+	}
+	b->generation = c->generation;
+	b->cap.count = c->count;
+	memcpy(b->cap.ais, c->ais, sizeof(c->ais));
+	return b;
+}
+
+/*
+ *
+ */
+void captureBlockFree(struct AnalogCaptureBlock* b) {
+	if (b != NULL) {
+		free(b->ts);
+		free(b->values);
+		free(b);
+	}
+}
+
+/*
+ *
+ */
+void captureListFree(struct AnalogCaptureBlock* b) {
+	while (b != NULL) {
+		struct AnalogCaptureBlock* next = b->next;
+		captureBlockFree(b);
+		b = next;
+	}
+}
+
+/*
+ * Starts the post-trigger phase if a block is available for the following
+ * recording. Called with captureMutex held.
+ */
+void captureTrigger(struct AnalogCapture* c, int type, int source,
+		int value, uint64_t micros) {
+	if (c->free == NULL) {
+		c->dropped++;
+		return;
+	}
+	c->reserved = c->free;
+	c->free = c->free->next;
+	c->triggered = TRUE;
+	c->triggerRow = c->rows;
+	c->remaining = c->post;
+	c->cur->cap.triggerType = type;
+	c->cur->cap.trigger = source;
+	c->cur->cap.triggerValue = value;
+	c->cur->cap.triggerMicros = micros;
+}
+
+/*
+ * Called by the interrupt thread of a digital input with a trigger.
+ */
+void analogCaptureEdge(struct DigitalInputConfig* diConf) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int value = digitalRead(diConf->digitalInput);
+	int mode = ATOMIC_GET(diConf->triggerMode);
+	if ((mode == INT_EDGE_RISING && value != HIGH)
+			|| (mode == INT_EDGE_FALLING && value != LOW)) {
+		return;
+	}
+
+	pthread_mutex_lock(&captureMutex);
+	struct AnalogCapture* c = analogCapture;
+	if (c != NULL && !c->triggered && !c->pendingTrigger) {
+		c->pendingTrigger = TRUE;
+		c->pendingSource = diConf->digitalInput;
+		c->pendingValue = value;
+		c->pendingMicros = (uint64_t) now.tv_sec * 1000000ULL
+				+ now.tv_nsec / 1000;
+	}
+	pthread_mutex_unlock(&captureMutex);
+}
+
+/*
+ * Called by the sampler thread after reading the analog inputs.
+ */
+void analogCaptureRow(struct timespec* ts) {
+	struct AnalogCaptureBlock* b;
+	unsigned int i, idx;
+	int c_, raw, prev, level;
+
+	pthread_mutex_lock(&captureMutex);
+	struct AnalogCapture* c = analogCapture;
+	if (c == NULL) {
+		pthread_mutex_unlock(&captureMutex);
+		return;
+	}
+
+	b = c->cur;
+	idx = c->rows % c->size;
+	b->ts[idx] = b->ts[idx + c->size] = (uint64_t) ts->tv_sec * 1000000ULL
+			+ ts->tv_nsec / 1000;
+	for (c_ = 0; c_ < c->count; c_++) {
+		raw = c->aiConfs[c_]->lastRaw;
+		b->values[idx * c->count + c_] = raw;
+		b->values[(idx + c->size) * c->count + c_] = raw;
+	}
+
+	if (!c->triggered) {
+		if (c->pendingTrigger) {
+			c->pendingTrigger = FALSE;
+			captureTrigger(c, IONOPI_TRIGGER_EDGE, c->pendingSource,
+					c->pendingValue, c->pendingMicros);
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		struct AnalogInputConfig* aiConf = &aiConfs[i];
+		if (aiConf->triggerMode == 0) {
+			continue;
+		}
+		raw = aiConf->lastRaw;
+		prev = aiConf->prevRaw;
+		level = aiConf->triggerLevel;
+		aiConf->prevRaw = raw;
+		if (aiConf->triggerSkip > 0) {
+			// the first samples may precede the trigger setup
+			aiConf->triggerSkip--;
+			continue;
+		}
+		if (!c->triggered
+				&& (((aiConf->triggerMode & INT_EDGE_RISING) && prev < level
+						&& raw >= level)
+						|| ((aiConf->triggerMode & INT_EDGE_FALLING)
+								&& prev >= level && raw < level))) {
+			captureTrigger(c, IONOPI_TRIGGER_LEVEL, aiConf->analogInput, raw,
+					b->ts[idx]);
+		}
+	}
+	c->rows++;
+
+	if (c->triggered && --c->remaining == 0) {
+		uint64_t pre = c->triggerRow < c->pre ? c->triggerRow : c->pre;
+		uint64_t first = c->triggerRow - pre;
+		idx = first % c->size;
+		b->cap.samples = pre + c->post;
+		b->cap.triggerIndex = pre;
+		b->cap.tsMicros = &b->ts[idx];
+		b->cap.values = &b->values[idx * c->count];
+		b->cap.dropped = c->dropped;
+		c->dropped = 0;
+		b->next = NULL;
+		if (c->readyTail == NULL) {
+			c->readyHead = b;
+		} else {
+			c->readyTail->next = b;
+		}
+		c->readyTail = b;
+		pthread_cond_broadcast(&captureCond);
+
+		c->cur = c->reserved;
+		c->reserved = NULL;
+		c->triggered = FALSE;
+		c->rows = 0;
+	}
+	pthread_mutex_unlock(&captureMutex);
+}
+
+/*
+ *
+ */
+int ionoPiAnalogCaptureSetup(const int* ais, int count,
+		unsigned int preSamples, unsigned int postSamples, int buffers) {
+	struct AnalogCapture* c;
+	int i;
+
+	if (ais == NULL || count < 1 || count > 4 || postSamples < 1
+			|| preSamples + postSamples > CAPTURE_SAMPLES_MAX
+			|| buffers < 1) {
+		return FALSE;
+	}
+	for (i = 0; i < count; i++) {
+		if (getAnalogInputConfig(ais[i]) == NULL) {
+			return FALSE;
+		}
+	}
+	ionoPiAnalogCaptureStop();
+
+	c = calloc(1, sizeof(struct AnalogCapture));
+	if (c == NULL) {
+		return FALSE;
+	}
+	c->count = count;
+	for (i = 0; i < count; i++) {
+		c->ais[i] = ais[i];
+		c->aiConfs[i] = getAnalogInputConfig(ais[i]);
+	}
+	c->pre = preSamples;
+	c->post = postSamples;
+	c->size = preSamples + postSamples;
+
+	pthread_mutex_lock(&captureMutex);
+	c->generation = ++analogCaptureGeneration;
+	// one recording, one reserved on trigger and the ones handed over
+	for (i = 0; i < buffers + 2; i++) {
+		struct AnalogCaptureBlock* b = captureBlockAlloc(c);
+		if (b == NULL) {
+			pthread_mutex_unlock(&captureMutex);
+			captureListFree(c->free);
+			free(c);
+			return FALSE;
+		}
+		b->next = c->free;
+		c->free = b;
+	}
+	c->cur = c->free;
+	c->free = c->free->next;
+
+	for (i = 0; i < count; i++) {
+		atomic_store(&c->aiConfs[i]->captureEnabled, TRUE);
+	}
+	for (i = 0; i < 4; i++) {
+		if (aiConfs[i].triggerMode != 0) {
+			aiConfs[i].triggerSkip = 2;
+			atomic_store(&aiConfs[i].captureEnabled, TRUE);
+		}
+	}
+	analogCapture = c;
+	atomic_store(&analogCaptureEnabled, TRUE);
+	pthread_mutex_unlock(&captureMutex);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogCaptureTriggerEdge(int di, int mode) {
+	struct DigitalInputConfig* diConf = getDigitalInputConfig(di);
+	if (diConf == NULL || mode < 0 || mode > INT_EDGE_BOTH) {
+		return FALSE;
+	}
+	atomic_store(&diConf->triggerMode, mode);
+	if (mode != 0) {
+		digitalInputISR(diConf);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogCaptureTriggerLevel(int ai, float voltage, int mode) {
+	struct AnalogInputConfig* aiConf = getAnalogInputConfig(ai);
+	if (aiConf == NULL || mode < 0 || mode > INT_EDGE_BOTH) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&captureMutex);
+	aiConf->triggerMode = mode;
+	aiConf->triggerLevel = voltageToRaw(ai, voltage);
+	aiConf->triggerSkip = 2;
+	if (analogCapture != NULL) {
+		int i, needed = (mode != 0);
+		for (i = 0; i < analogCapture->count; i++) {
+			needed |= (analogCapture->aiConfs[i] == aiConf);
+		}
+		atomic_store(&aiConf->captureEnabled, needed);
+	}
+	pthread_mutex_unlock(&captureMutex);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogCaptureStop() {
+	int i;
+	pthread_mutex_lock(&captureMutex);
+	struct AnalogCapture* c = analogCapture;
+	atomic_store(&analogCaptureEnabled, FALSE);
+	analogCapture = NULL;
+	for (i = 0; i < 4; i++) {
+		atomic_store(&aiConfs[i].captureEnabled, FALSE);
+	}
+	pthread_cond_broadcast(&captureCond);
+	pthread_mutex_unlock(&captureMutex);
+	if (c == NULL) {
+		return FALSE;
+	}
+	// blocks held by the application are freed when released
+	captureListFree(c->free);
+	captureListFree(c->readyHead);
+	captureBlockFree(c->cur);
+	captureBlockFree(c->reserved);
+	free(c);
+	return TRUE;
+}
+
+/*
+ *
+ */
+const struct IonoPiAnalogCapture* ionoPiAnalogCaptureWait(int timeoutMillis) {
+	struct AnalogCaptureBlock* b = NULL;
+	struct timespec deadline;
+	int err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (timeoutMillis > 0) {
+		deadline.tv_sec += timeoutMillis / 1000;
+		deadline.tv_nsec += (timeoutMillis % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&captureMutex);
+	while (analogCapture != NULL && analogCapture->readyHead == NULL
+			&& timeoutMillis != 0 && err == 0) {
+		if (timeoutMillis < 0) {
+			pthread_cond_wait(&captureCond, &captureMutex);
+		} else {
+			err = pthread_cond_timedwait(&captureCond, &captureMutex,
+					&deadline);
+		}
+	}
+	if (analogCapture != NULL && analogCapture->readyHead != NULL) {
+		b = analogCapture->readyHead;
+		analogCapture->readyHead = b->next;
+		if (analogCapture->readyHead == NULL) {
+			analogCapture->readyTail = NULL;
+		}
+	}
+	pthread_mutex_unlock(&captureMutex);
+	return b != NULL ? &b->cap : NULL;
+}
+
+/*
+ *
+ */
+void ionoPiAnalogCaptureRelease(const struct IonoPiAnalogCapture* cap) {
+	struct AnalogCaptureBlock* b = (struct AnalogCaptureBlock*) cap;
+	if (b == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&captureMutex);
+	if (analogCapture != NULL
+			&& b->generation == analogCapture->generation) {
+		b->next = analogCapture->free;
+		analogCapture->free = b;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&captureMutex);
+	// from a stopped capture
+	captureBlockFree(b);
+}
+
+/*
+ * Samples the active analog inputs until the sampling period is set to 0.
+ */
+void *analogSampler(void* arg) {
+	struct timespec next, now;
+	unsigned int period_usec, mask;
+	int raw[MCP_CHANNELS];
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		while ((period_usec = ATOMIC_GET(analogPeriod_usec)) != 0) {
+			checkRealtime(IONOPI_THREAD_ANALOG);
+			// all the active inputs converted in a single transfer
+			mask = 0;
+			for (i = 0; i < 4; i++) {
+				if (analogInputActive(&aiConfs[i])) {
+					mask |= 1 << adcChannel(aiConfs[i].analogInput);
+				}
+			}
+			if (mask != 0 && adcRead(mask, raw,
+					ATOMIC_GET(adcFreshness_usec))) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				for (i = 0; i < 4; i++) {
+					if (mask & (1 << adcChannel(aiConfs[i].analogInput))) {
+						analogSample(&aiConfs[i],
+								raw[adcChannel(aiConfs[i].analogInput)], &now);
+					}
+				}
+			}
+			if (ATOMIC_GET(analogCaptureEnabled)) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				analogCaptureRow(&now);
+			}
+
+			next.tv_sec += period_usec / 1000000;
+			next.tv_nsec += (period_usec % 1000000) * 1000L;
+			if (next.tv_nsec >= 1000000000L) {
+				next.tv_sec += 1;
+				next.tv_nsec -= 1000000000L;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (diff_usec(&now, &next) > period_usec) {
+				// overrun, restart from now
+				next = now;
+				continue;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL) == EINTR) {
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			recordTiming(IONOPI_THREAD_ANALOG, diff_usec(&next, &now));
+		}
+
+		atomic_store(&analogSamplerRunning, FALSE);
+		// sampling may have been restarted before the flag was cleared
+		if (atomic_load(&analogPeriod_usec) == 0
+				|| atomic_exchange(&analogSamplerRunning, TRUE)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogSampling(unsigned int periodMicros) {
+	atomic_store(&analogPeriod_usec, periodMicros);
+	if (periodMicros == 0 || atomic_exchange(&analogSamplerRunning, TRUE)) {
+		return TRUE;
+	}
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, analogSampler, NULL);
+	if (err != 0) {
+		atomic_store(&analogSamplerRunning, FALSE);
+		return FALSE;
+	}
+	pthread_detach(thread);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogComparator(int ai, float lowVoltage, float highVoltage,
+		unsigned int dwellMillis, void (*callBack)(int, int, float)) {
+	struct AnalogInputConfig* aiConf = getAnalogInputConfig(ai);
+	if (aiConf == NULL || lowVoltage > highVoltage) {
+		return FALSE;
+	}
+	seqWriteBegin(&aiConf->cmpSeq);
+	ATOMIC_SET(aiConf->cmpLow, voltageToRaw(ai, lowVoltage));
+	ATOMIC_SET(aiConf->cmpHigh, voltageToRaw(ai, highVoltage));
+	ATOMIC_SET(aiConf->cmpDwellMillis, dwellMillis);
+	ATOMIC_SET(aiConf->cmpCallBack, callBack);
+	seqWriteEnd(&aiConf->cmpSeq);
+	if (!atomic_exchange(&aiConf->cmpEnabled, TRUE)) {
+		atomic_store(&aiConf->cmpState, -1);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogComparatorDisable(int ai) {
+	struct AnalogInputConfig* aiConf = getAnalogInputConfig(ai);
+	if (aiConf == NULL) {
+		return FALSE;
+	}
+	atomic_store(&aiConf->cmpEnabled, FALSE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiAnalogComparatorRead(int ai) {
+	struct AnalogInputConfig* aiConf = getAnalogInputConfig(ai);
+	if (aiConf == NULL || !ATOMIC_GET(aiConf->cmpEnabled)) {
+		return -1;
+	}
+	return atomic_load(&aiConf->cmpState);
+}
+
+/*
+ *
+ */
+int ionoPiAnalogComparatorFd() {
+	int fd = ATOMIC_GET(analogEventFd);
+	if (fd >= 0) {
+		return fd;
+	}
+	int newFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (newFd < 0) {
+		return -1;
+	}
+	if (!atomic_compare_exchange_strong(&analogEventFd, &fd, newFd)) {
+		close(newFd);
+		return fd;
+	}
+	return newFd;
 }
 
 int readRHT03Fixed(const int pin, int *temp, int *rh) {
@@ -469,6 +3346,9 @@ int readRHT03Fixed(const int pin, int *temp, int *rh) {
 int ionoPi1WireMaxDetectRead(const int ttl, const int attempts, int *temp,
 		int *rh) {
 	int i;
+	if (!setupSubsystems(SETUP_GPIO)) {
+		return FALSE;
+	}
 	for (i = 0; i < attempts; i++) {
 		if (readRHT03Fixed(ttl, temp, rh)) {
 			return TRUE;
@@ -577,6 +3457,137 @@ int read1WireBusDevice(const char* devicePath, int *temp) {
 	return TRUE;
 }
 
+/*
+ * Resolution and conversion time of the 1-Wire bus devices, read from the
+ * w1_therm sysfs attributes on first use and updated when set, so that
+ * they are not read from the bus every time. Protected by oneWireMutex.
+ */
+struct OneWireDevice {
+	char id[32];
+	int resolution;
+	unsigned int convMillis;
+} oneWireCache[ONEWIRE_CACHE_SIZE];
+
+int oneWireCacheCount = 0;
+pthread_mutex_t oneWireMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *
+ */
+int read1WireAttr(const char* deviceId, const char* attr, int* value) {
+	char path[80];
+	FILE *fp;
+	int ok;
+	snprintf(path, sizeof(path), "%s%s/%s", ONEWIRE_DEVICES_PATH, deviceId,
+			attr);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return FALSE;
+	}
+	ok = fscanf(fp, "%d", value) == 1;
+	fclose(fp);
+	return ok;
+}
+
+/*
+ * Requires root privileges.
+ */
+int write1WireAttr(const char* deviceId, const char* attr, int value) {
+	char path[80];
+	FILE *fp;
+	int ok;
+	snprintf(path, sizeof(path), "%s%s/%s", ONEWIRE_DEVICES_PATH, deviceId,
+			attr);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		return FALSE;
+	}
+	ok = fprintf(fp, "%d", value) > 0;
+	ok = fclose(fp) == 0 && ok;
+	return ok;
+}
+
+/*
+ * Conversion time of the DS18B20 at the given resolution: 93.75 ms at 9
+ * bits, doubling with each bit.
+ */
+unsigned int oneWireNominalMillis(int bits) {
+	int shift = ONEWIRE_RESOLUTION_MAX - bits;
+	return (750 + (1 << shift) - 1) >> shift;
+}
+
+/*
+ * Returns the cache entry of the device, reading its attributes if not
+ * known, or NULL if they cannot be read. Called with oneWireMutex held.
+ */
+struct OneWireDevice* oneWireDevice(const char* deviceId) {
+	struct OneWireDevice* dev = NULL;
+	int i, bits, convMillis;
+
+	if (deviceId == NULL || strchr(deviceId, '/') != NULL
+			|| strlen(deviceId) >= sizeof(dev->id)) {
+		return NULL;
+	}
+	for (i = 0; i < oneWireCacheCount; i++) {
+		if (strcmp(oneWireCache[i].id, deviceId) == 0) {
+			dev = &oneWireCache[i];
+			break;
+		}
+	}
+	if (dev != NULL && dev->resolution != 0) {
+		return dev;
+	}
+	if (!read1WireAttr(deviceId, "resolution", &bits)
+			|| bits < ONEWIRE_RESOLUTION_MIN || bits > ONEWIRE_RESOLUTION_MAX) {
+		return NULL;
+	}
+	if (dev == NULL) {
+		if (oneWireCacheCount == ONEWIRE_CACHE_SIZE) {
+			// evict the oldest entry
+			memmove(&oneWireCache[0], &oneWireCache[1],
+					(ONEWIRE_CACHE_SIZE - 1) * sizeof(struct OneWireDevice));
+			oneWireCacheCount--;
+		}
+		dev = &oneWireCache[oneWireCacheCount++];
+		snprintf(dev->id, sizeof(dev->id), "%s", deviceId);
+	}
+	dev->resolution = bits;
+	// conv_time is only available on recent kernels
+	if (read1WireAttr(deviceId, "conv_time", &convMillis) && convMillis > 0) {
+		dev->convMillis = convMillis;
+	} else {
+		dev->convMillis = oneWireNominalMillis(bits);
+	}
+	return dev;
+}
+
+/*
+ * Conversion time of the device at the given resolution, scaled from the
+ * one at its current resolution so that the timing reported by the driver
+ * is kept. Called with oneWireMutex held.
+ */
+unsigned int oneWireConvMillis(const struct OneWireDevice* dev, int bits) {
+	if (bits >= dev->resolution) {
+		return dev->convMillis << (bits - dev->resolution);
+	}
+	int shift = dev->resolution - bits;
+	return (dev->convMillis + (1U << shift) - 1) >> shift;
+}
+
+/*
+ *
+ */
+void oneWireInvalidate(const char* deviceId) {
+	int i;
+	pthread_mutex_lock(&oneWireMutex);
+	for (i = 0; i < oneWireCacheCount; i++) {
+		if (strcmp(oneWireCache[i].id, deviceId) == 0) {
+			oneWireCache[i].resolution = 0;
+		}
+	}
+	pthread_mutex_unlock(&oneWireMutex);
+}
+
 /*
  *
  */
@@ -588,69 +3599,173 @@ int ionoPi1WireBusReadTemperature(const char* deviceId, const int attempts,
 	int i;
 	for (i = 0; i < attempts; i++) {
 		if (read1WireBusDevice(path, temp)) {
+			stats1WireAdd(deviceId, *temp);
 			return TRUE;
 		}
 	}
+	// the device may have been power cycled, back to its default resolution
+	oneWireInvalidate(deviceId);
 	return FALSE;
 }
 
 /*
  *
  */
-unsigned long int to_usec(time_t t_sec, long int t_nsec) {
-	return (t_sec * 1000000UL) + (t_nsec / 1000UL);
+int ionoPi1WireBusGetResolution(const char* deviceId, int* bits,
+		unsigned int* convMillis) {
+	struct OneWireDevice* dev;
+	int ok = FALSE;
+	pthread_mutex_lock(&oneWireMutex);
+	dev = oneWireDevice(deviceId);
+	if (dev != NULL) {
+		if (bits != NULL) {
+			*bits = dev->resolution;
+		}
+		if (convMillis != NULL) {
+			*convMillis = dev->convMillis;
+		}
+		ok = TRUE;
+	}
+	pthread_mutex_unlock(&oneWireMutex);
+	return ok;
 }
 
 /*
  *
  */
-unsigned long int diff_usec(struct timespec* t1, struct timespec* t2) {
-	time_t diff_sec = t2->tv_sec - t1->tv_sec;
-	long int diff_nsec = t2->tv_nsec - t1->tv_nsec;
-	if (diff_nsec < 0) {
-		diff_sec -= 1;
-		diff_nsec += 1000000000L;
+int ionoPi1WireBusSetResolution(const char* deviceId, int bits) {
+	struct OneWireDevice* dev;
+	int ok = FALSE;
+	if (bits < ONEWIRE_RESOLUTION_MIN || bits > ONEWIRE_RESOLUTION_MAX) {
+		return FALSE;
 	}
-	return to_usec(diff_sec, diff_nsec);
+	pthread_mutex_lock(&oneWireMutex);
+	dev = oneWireDevice(deviceId);
+	if (dev != NULL) {
+		if (dev->resolution == bits) {
+			ok = TRUE;
+		} else if (write1WireAttr(deviceId, "resolution", bits)) {
+			// let the driver compute the conversion time for the resolution
+			write1WireAttr(deviceId, "conv_time", 0);
+			dev->resolution = 0;
+			dev = oneWireDevice(deviceId);
+			ok = dev != NULL && dev->resolution == bits;
+		}
+	}
+	pthread_mutex_unlock(&oneWireMutex);
+	return ok;
 }
 
 /*
  *
  */
-void wData(volatile struct Wiegand* w, int ttl, int bitVal) {
-	struct timespec now;
+int ionoPi1WireBusRequest(const char* deviceId, float precision,
+		unsigned int maxLatencyMillis) {
+	struct OneWireDevice* dev;
+	unsigned int convMillis;
+	int bits = ONEWIRE_RESOLUTION_MIN;
+	// each bit halves the 0.5 °C step of the minimum resolution
+	while (bits < ONEWIRE_RESOLUTION_MAX
+			&& 0.5f / (1 << (bits - ONEWIRE_RESOLUTION_MIN)) > precision) {
+		bits++;
+	}
+	pthread_mutex_lock(&oneWireMutex);
+	dev = oneWireDevice(deviceId);
+	convMillis = dev != NULL ? oneWireConvMillis(dev, bits) : 0;
+	pthread_mutex_unlock(&oneWireMutex);
+	if (dev == NULL
+			|| (maxLatencyMillis > 0 && convMillis > maxLatencyMillis)) {
+		return FALSE;
+	}
+	return ionoPi1WireBusSetResolution(deviceId, bits);
+}
+
+/*
+ *
+ */
+void getWiegandPulse(unsigned int *maxWidth_usec,
+		unsigned int *intervalMin_usec, unsigned int *intervalMax_usec) {
+	unsigned int seq;
+	do {
+		seq = seqReadBegin(&wiegandPulse.seq);
+		*maxWidth_usec = ATOMIC_GET(wiegandPulse.maxWidth_usec);
+		*intervalMin_usec = ATOMIC_GET(wiegandPulse.intervalMin_usec);
+		*intervalMax_usec = ATOMIC_GET(wiegandPulse.intervalMax_usec);
+	} while (seqReadRetry(&wiegandPulse.seq, seq));
+}
+
+/*
+ * Called by the ISR threads of both data lines, serialized by the frame's
+ * seqlock.
+ */
+void wData(struct Wiegand* w, int ttl, int bitVal) {
+	struct timespec now, pulseWidthMax, lastBitTs, sampled;
+	unsigned int maxWidth_usec, intervalMin_usec, intervalMax_usec;
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if (!w->run || w->bitCount >= WIEGAND_MAX_BITS) {
+	if (!ATOMIC_GET(w->run) && !ATOMIC_GET(w->accessRun)) {
 		return;
 	}
 
-	nanosleep(&wiegandPulseWidthMax, NULL);
-	if (digitalRead(ttl) == LOW) {
-		// pulse too long
-		w->bitCount = 0;
-		w->data = 0;
-		return;
+	atomic_fetch_add(&w->bitsPending, 1);
+	checkRealtime(IONOPI_THREAD_WIEGAND);
+
+	getWiegandPulse(&maxWidth_usec, &intervalMin_usec, &intervalMax_usec);
+	pulseWidthMax.tv_sec = maxWidth_usec / 1000000L;
+	pulseWidthMax.tv_nsec = (maxWidth_usec % 1000000L) * 1000L;
+	nanosleep(&pulseWidthMax, NULL);
+	int pulseTooLong = (digitalRead(ttl) == LOW);
+	clock_gettime(CLOCK_MONOTONIC, &sampled);
+	unsigned long int sampledAfter = diff_usec(&now, &sampled);
+	recordTiming(IONOPI_THREAD_WIEGAND,
+			sampledAfter > maxWidth_usec ? sampledAfter - maxWidth_usec : 0);
+
+	unsigned int seq = seqWriteBegin(&w->seq);
+	int bitCount = ATOMIC_GET(w->bitCount);
+	uint64_t data = ((uint64_t) ATOMIC_GET(w->dataHi) << 32)
+			| ATOMIC_GET(w->dataLo);
+
+	if (ATOMIC_GET(w->deliveredSeq) == seq) {
+		// frame already handed to the monitor, start a new one
+		bitCount = 0;
+		data = 0;
 	}
 
-	if (w->bitCount != 0) {
-		unsigned long int diff = diff_usec((struct timespec *) &(w->lastBitTs),
-				&now);
-		if (diff < wiegandPulseIntervalMin_usec
-				|| diff > wiegandPulseIntervalMax_usec) {
+	if (pulseTooLong) {
+		atomic_fetch_add(&timingStats[IONOPI_THREAD_WIEGAND].errors, 1);
+		bitCount = 0;
+		data = 0;
+	} else if (bitCount < WIEGAND_MAX_BITS) {
+		unsigned long int diff = 0;
+		if (bitCount != 0) {
+			lastBitTs.tv_sec = ATOMIC_GET(w->lastBitSec);
+			lastBitTs.tv_nsec = ATOMIC_GET(w->lastBitNsec);
+			diff = diff_usec(&lastBitTs, &now);
+		}
+		if (bitCount != 0
+				&& (diff < intervalMin_usec || diff > intervalMax_usec)) {
 			// pulse too early or too late
-			w->bitCount = 0;
-			w->data = 0;
-			return;
+			atomic_fetch_add(&timingStats[IONOPI_THREAD_WIEGAND].errors, 1);
+			bitCount = 0;
+			data = 0;
+		} else {
+			ATOMIC_SET(w->lastBitSec, now.tv_sec);
+			ATOMIC_SET(w->lastBitNsec, now.tv_nsec);
+			data <<= 1;
+			data |= bitVal;
+			bitCount++;
 		}
 	}
 
-	w->lastBitTs.tv_sec = now.tv_sec;
-	w->lastBitTs.tv_nsec = now.tv_nsec;
+	ATOMIC_SET(w->bitCount, bitCount);
+	ATOMIC_SET(w->dataHi, data >> 32);
+	ATOMIC_SET(w->dataLo, data & 0xFFFFFFFF);
+	seqWriteEnd(&w->seq);
+	atomic_fetch_sub(&w->bitsPending, 1);
 
-	w->data <<= 1;
-	w->data |= bitVal;
-	w->bitCount++;
+	if (ATOMIC_GET(w->accessRun)) {
+		sem_post(&w->accessSem);
+	}
 }
 
 void w1Data0() {
@@ -674,63 +3789,126 @@ void w2Data1() {
  */
 void ionoPiSetWiegandPulse(unsigned int maxWidthMicros,
 		unsigned int minIntervalMicros, unsigned int maxIntervalMicros) {
-	wiegandPulseWidthMax.tv_sec = maxWidthMicros / 1000000L;
-	wiegandPulseWidthMax.tv_nsec = (maxWidthMicros % 1000000L) * 1000L;
-	wiegandPulseIntervalMin_usec = minIntervalMicros;
-	wiegandPulseIntervalMax_usec = maxIntervalMicros;
+	seqWriteBegin(&wiegandPulse.seq);
+	ATOMIC_SET(wiegandPulse.maxWidth_usec, maxWidthMicros);
+	ATOMIC_SET(wiegandPulse.intervalMin_usec, minIntervalMicros);
+	ATOMIC_SET(wiegandPulse.intervalMax_usec, maxIntervalMicros);
+	seqWriteEnd(&wiegandPulse.seq);
 }
 
 /*
- *
+ * Time without bits after which a frame is considered complete.
  */
-int ionoPiWiegandMonitor(int interface, int (*callBack)(int, int, uint64_t)) {
-	if (callBack == NULL) {
+unsigned long int wiegandTimeout_usec(unsigned int intervalMax_usec) {
+	unsigned long int timeout_usec = intervalMax_usec * 3;
+	if (timeout_usec < 200000) {
+		timeout_usec = 200000;
+	}
+	return timeout_usec;
+}
+
+/*
+ * Sets the data lines of the given sender back to inputs, for a receiver.
+ * Returns FALSE if the sender is transmitting.
+ */
+int wiegandSenderRelease(struct WiegandSender* ws) {
+	pthread_mutex_lock(&ws->mutex);
+	if (ws->size > 0 || ws->busy) {
+		pthread_mutex_unlock(&ws->mutex);
 		return FALSE;
 	}
-	volatile struct Wiegand* w;
+	if (ws->output) {
+		pinMode(ws->data0, INPUT);
+		pinMode(ws->data1, INPUT);
+		ws->output = FALSE;
+	}
+	pthread_mutex_unlock(&ws->mutex);
+	return TRUE;
+}
+
+/*
+ * Returns the interface, registering the ISRs of its data lines on first
+ * use, or NULL if invalid or if its sender is transmitting.
+ */
+struct Wiegand* wiegandInterface(int interface) {
+	struct Wiegand* w;
+	if (!setupSubsystems(SETUP_GPIO)) {
+		return NULL;
+	}
+	if (interface < 1 || interface > 2
+			|| !wiegandSenderRelease(&wSenders[interface - 1])) {
+		return NULL;
+	}
 	if (interface == 1) {
 		w = &w1;
-		if (!w1DataRegistered) {
-			w1DataRegistered = 1;
+		if (!atomic_exchange(&w->isrRegistered, TRUE)) {
 			wiringPiISR(TTL1, INT_EDGE_FALLING, w1Data0);
 			wiringPiISR(TTL2, INT_EDGE_FALLING, w1Data1);
 		}
 	} else if (interface == 2) {
 		w = &w2;
-		if (!w2DataRegistered) {
-			w2DataRegistered = 1;
+		if (!atomic_exchange(&w->isrRegistered, TRUE)) {
 			wiringPiISR(TTL3, INT_EDGE_FALLING, w2Data0);
 			wiringPiISR(TTL4, INT_EDGE_FALLING, w2Data1);
 		}
 	} else {
+		return NULL;
+	}
+	return w;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandMonitor(int interface, int (*callBack)(int, int, uint64_t)) {
+	if (callBack == NULL) {
+		return FALSE;
+	}
+	struct Wiegand* w = wiegandInterface(interface);
+	if (w == NULL) {
 		return FALSE;
 	}
 
-	struct timespec now;
+	struct timespec now, lastBitTs;
 	unsigned long int diff;
-	unsigned long int timeout_usec = wiegandPulseIntervalMax_usec * 3;
-	if (timeout_usec < 200000) {
-		timeout_usec = 200000;
-	}
+	unsigned int maxWidth_usec, intervalMin_usec, intervalMax_usec;
+	getWiegandPulse(&maxWidth_usec, &intervalMin_usec, &intervalMax_usec);
+	unsigned long int timeout_usec = wiegandTimeout_usec(intervalMax_usec);
 	unsigned int delay_ms = timeout_usec / 4000;
+	unsigned int seq;
+	int bitCount;
+	uint64_t data;
+
+	seq = seqWriteBegin(&w->seq);
+	ATOMIC_SET(w->bitCount, 0);
+	ATOMIC_SET(w->dataHi, 0);
+	ATOMIC_SET(w->dataLo, 0);
+	seqWriteEnd(&w->seq);
+	atomic_store(&w->deliveredSeq, seq + 2);
+	atomic_store(&w->run, TRUE);
 
-	w->data = 0;
-	w->bitCount = 0;
-	w->run = 1;
+	while (ATOMIC_GET(w->run)) {
+		checkRealtime(IONOPI_THREAD_WIEGAND);
+		do {
+			seq = seqReadBegin(&w->seq);
+			bitCount = ATOMIC_GET(w->bitCount);
+			data = ((uint64_t) ATOMIC_GET(w->dataHi) << 32)
+					| ATOMIC_GET(w->dataLo);
+			lastBitTs.tv_sec = ATOMIC_GET(w->lastBitSec);
+			lastBitTs.tv_nsec = ATOMIC_GET(w->lastBitNsec);
+		} while (seqReadRetry(&w->seq, seq));
 
-	while (w->run) {
-		if (w->bitCount > 0) {
+		if (bitCount > 0 && seq != ATOMIC_GET(w->deliveredSeq)) {
 			clock_gettime(CLOCK_MONOTONIC, &now);
-			diff = diff_usec((struct timespec *) &w->lastBitTs, &now);
+			diff = diff_usec(&lastBitTs, &now);
 			if (diff >= timeout_usec) {
-				if (w->bitCount >= 4) {
-					if (!callBack(interface, w->bitCount, w->data)) {
-						w->run = 0;
+				atomic_store(&w->deliveredSeq, seq);
+				if (bitCount >= 4) {
+					if (!callBack(interface, bitCount, data)) {
+						atomic_store(&w->run, FALSE);
 						return TRUE;
 					}
 				}
-				w->data = 0;
-				w->bitCount = 0;
 			}
 		}
 		delay(delay_ms);
@@ -744,11 +3922,359 @@ int ionoPiWiegandMonitor(int interface, int (*callBack)(int, int, uint64_t)) {
  */
 int ionoPiWiegandStop(int interface) {
 	if (interface == 1) {
-		w1.run = 0;
+		atomic_store(&w1.run, FALSE);
+	} else if (interface == 2) {
+		atomic_store(&w2.run, FALSE);
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Waits until the given time: sleeps until shortly before it, then spins
+ * to avoid the wake-up latency.
+ */
+void waitUntil(struct timespec* t) {
+	struct timespec now, wake = *t;
+	wake.tv_nsec -= WIEGAND_SEND_SPIN_USEC * 1000L;
+	if (wake.tv_nsec < 0) {
+		wake.tv_sec -= 1;
+		wake.tv_nsec += 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+			== EINTR) {
+	}
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < t->tv_sec
+			|| (now.tv_sec == t->tv_sec && now.tv_nsec < t->tv_nsec));
+}
+
+/*
+ *
+ */
+void getWiegandAccessConf(struct Wiegand* w, int* output,
+		unsigned int* pulseMillis) {
+	unsigned int seq;
+	do {
+		seq = seqReadBegin(&w->accessSeq);
+		*output = ATOMIC_GET(w->accessOutput);
+		*pulseMillis = ATOMIC_GET(w->accessPulseMillis);
+	} while (seqReadRetry(&w->accessSeq, seq));
+}
+
+/*
+ * Decides on the frames of an interface as soon as they are complete,
+ * independently of the monitor. A frame is complete when no bit has been
+ * received for the maximum bit interval, after which a new bit would be
+ * rejected anyway, plus the time wData() takes to sample it, and no bit is
+ * being sampled. The thread is woken up by wData() on every bit and while a
+ * relay pulse is in progress.
+ */
+void *wiegandAccess(void* arg) {
+	struct Wiegand* w = (struct Wiegand*) arg;
+	struct timespec now, lastBitTs, complete, pulseEnd;
+	unsigned int maxWidth_usec, intervalMin_usec, intervalMax_usec;
+	unsigned int pulseMillis, seq;
+	// never a stable seq value, so that a frame in progress is decided
+	unsigned int decidedSeq = 1;
+	int output, pulseOutput = -1, bitCount, ret;
+	uint64_t data;
+
+	for (;;) {
+		while (ATOMIC_GET(w->accessRun) || pulseOutput >= 0) {
+			checkRealtime(IONOPI_THREAD_WIEGAND);
+			if (pulseOutput >= 0) {
+				ret = sem_clockwait(&w->accessSem, CLOCK_MONOTONIC, &pulseEnd);
+			} else {
+				ret = sem_wait(&w->accessSem);
+			}
+			if (ret == 0) {
+				while (sem_trywait(&w->accessSem) == 0) {
+				}
+			}
+
+			for (;;) {
+				do {
+					seq = seqReadBegin(&w->seq);
+					bitCount = ATOMIC_GET(w->bitCount);
+					data = ((uint64_t) ATOMIC_GET(w->dataHi) << 32)
+							| ATOMIC_GET(w->dataLo);
+					lastBitTs.tv_sec = ATOMIC_GET(w->lastBitSec);
+					lastBitTs.tv_nsec = ATOMIC_GET(w->lastBitNsec);
+				} while (seqReadRetry(&w->seq, seq));
+
+				if (bitCount == 0 || seq == decidedSeq
+						|| seq == ATOMIC_GET(w->deliveredSeq)) {
+					break;
+				}
+				getWiegandPulse(&maxWidth_usec, &intervalMin_usec,
+						&intervalMax_usec);
+				complete = lastBitTs;
+				addMicros(&complete, intervalMax_usec + maxWidth_usec
+						+ WIEGAND_ACCESS_MARGIN_USEC);
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (ATOMIC_GET(w->bitsPending) > 0
+						&& !timeBefore(&now, &complete)) {
+					// a late bit is still being sampled, wait for it
+					complete = now;
+					addMicros(&complete, maxWidth_usec);
+				}
+				if (timeBefore(&now, &complete)) {
+					while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+							&complete, NULL) == EINTR) {
+					}
+					continue;
+				}
+
+				decidedSeq = seq;
+				if (!ATOMIC_GET(w->run)) {
+					// no monitor, let wData() start a new frame
+					atomic_store(&w->deliveredSeq, seq);
+				}
+				if (bitCount < 4) {
+					break;
+				}
+				getWiegandAccessConf(w, &output, &pulseMillis);
+				if (output >= 0 && accessTableMatch(bitCount, data)) {
+					if (pulseOutput >= 0 && pulseOutput != output) {
+						digitalWrite(pulseOutput, OPEN);
+					}
+					digitalWrite(output, CLOSED);
+					pulseOutput = output;
+					pulseEnd = now;
+					addMillis(&pulseEnd, pulseMillis);
+					atomic_fetch_add(&w->accessGranted, 1);
+				} else {
+					atomic_fetch_add(&w->accessDenied, 1);
+				}
+				break;
+			}
+
+			if (pulseOutput >= 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (!timeBefore(&now, &pulseEnd)) {
+					digitalWrite(pulseOutput, OPEN);
+					pulseOutput = -1;
+				}
+			}
+		}
+
+		atomic_store(&w->accessThreadRunning, FALSE);
+		// access may have been re-enabled before the flag was cleared
+		if (!atomic_load(&w->accessRun)
+				|| atomic_exchange(&w->accessThreadRunning, TRUE)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandAccess(int interface, int output, unsigned int pulseMillis) {
+	pthread_t thread;
+
+	if (output >= 0 && output != O1 && output != O2 && output != O3
+			&& output != O4 && output != OC1 && output != OC2
+			&& output != OC3) {
+		return FALSE;
+	}
+	if (output >= 0 && pulseMillis == 0) {
+		return FALSE;
+	}
+	struct Wiegand* w = wiegandInterface(interface);
+	if (w == NULL) {
+		return FALSE;
+	}
+	if (!atomic_exchange(&w->accessSemInit, TRUE)) {
+		sem_init(&w->accessSem, 0, 0);
+	}
+
+	seqWriteBegin(&w->accessSeq);
+	ATOMIC_SET(w->accessOutput, output);
+	ATOMIC_SET(w->accessPulseMillis, pulseMillis);
+	seqWriteEnd(&w->accessSeq);
+
+	if (output < 0) {
+		atomic_store(&w->accessRun, FALSE);
+		sem_post(&w->accessSem);
+		return TRUE;
+	}
+
+	atomic_store(&w->accessRun, TRUE);
+	if (!atomic_exchange(&w->accessThreadRunning, TRUE)) {
+		if (pthread_create(&thread, NULL, wiegandAccess, w) != 0) {
+			atomic_store(&w->accessRun, FALSE);
+			atomic_store(&w->accessThreadRunning, FALSE);
+			return FALSE;
+		}
+		pthread_detach(thread);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetWiegandAccessStats(int interface,
+		struct IonoPiWiegandAccessStats* stats, int reset) {
+	struct Wiegand* w;
+	if (interface == 1) {
+		w = &w1;
+	} else if (interface == 2) {
+		w = &w2;
+	} else {
+		return FALSE;
+	}
+	if (stats == NULL) {
+		return FALSE;
+	}
+	if (reset) {
+		stats->granted = atomic_exchange(&w->accessGranted, 0);
+		stats->denied = atomic_exchange(&w->accessDenied, 0);
+	} else {
+		stats->granted = atomic_load(&w->accessGranted);
+		stats->denied = atomic_load(&w->accessDenied);
+	}
+	return TRUE;
+}
+
+/*
+ * Sends the queued frames. The pulse width is half the maximum accepted
+ * one and the interval the middle of the accepted range, as set with
+ * ionoPiSetWiegandPulse(), so that a receiver using the same parameters
+ * has the largest margins. The delay of each bit is recorded in the timing
+ * statistics, bits that could be rejected by the receiver count as errors.
+ */
+void *wiegandSender(void* arg) {
+	struct WiegandSender* ws = (struct WiegandSender*) arg;
+	unsigned int maxWidth_usec, intervalMin_usec, intervalMax_usec;
+	struct timespec t, start, end;
+	uint64_t data;
+	int bitCount, i;
+
+	for (;;) {
+		pthread_mutex_lock(&ws->mutex);
+		ws->busy = FALSE;
+		while (ws->size == 0) {
+			pthread_cond_broadcast(&ws->cond);
+			pthread_cond_wait(&ws->cond, &ws->mutex);
+		}
+		data = ws->data[ws->head];
+		bitCount = ws->bitCount[ws->head];
+		ws->head = (ws->head + 1) % WIEGAND_SEND_QUEUE_SIZE;
+		ws->size--;
+		ws->busy = TRUE;
+		if (!ws->output) {
+			// released to a receiver since the last frame
+			digitalWrite(ws->data0, HIGH);
+			digitalWrite(ws->data1, HIGH);
+			pinMode(ws->data0, OUTPUT);
+			pinMode(ws->data1, OUTPUT);
+			ws->output = TRUE;
+		}
+		pthread_mutex_unlock(&ws->mutex);
+
+		checkRealtime(IONOPI_THREAD_WIEGAND_OUT);
+		getWiegandPulse(&maxWidth_usec, &intervalMin_usec, &intervalMax_usec);
+		unsigned int width_usec = maxWidth_usec / 2;
+		unsigned int interval_usec = (intervalMin_usec + intervalMax_usec) / 2;
+
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		addMicros(&t, WIEGAND_SEND_SPIN_USEC);
+		for (i = bitCount - 1; i >= 0; i--) {
+			int pin = ((data >> i) & 1) ? ws->data1 : ws->data0;
+			waitUntil(&t);
+			digitalWrite(pin, LOW);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			end = start;
+			addMicros(&end, width_usec);
+			waitUntil(&end);
+			digitalWrite(pin, HIGH);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			unsigned long int late_usec = diff_usec(&t, &start);
+			recordTiming(IONOPI_THREAD_WIEGAND_OUT, late_usec);
+			if (diff_usec(&start, &end) > maxWidth_usec
+					|| late_usec > intervalMax_usec - interval_usec) {
+				atomic_fetch_add(
+						&timingStats[IONOPI_THREAD_WIEGAND_OUT].errors, 1);
+			}
+			addMicros(&t, interval_usec);
+		}
+
+		// keep the lines idle long enough for the receiver to end the frame
+		addMicros(&t, wiegandTimeout_usec(intervalMax_usec) * 3 / 2);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)
+				== EINTR) {
+		}
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandSend(int interface, uint64_t data, int bitCount) {
+	struct WiegandSender* ws;
+	if (interface == 1 && !ATOMIC_GET(w1.run) && !ATOMIC_GET(w1.accessRun)) {
+		ws = &wSenders[0];
+	} else if (interface == 2 && !ATOMIC_GET(w2.run)
+			&& !ATOMIC_GET(w2.accessRun)) {
+		ws = &wSenders[1];
+	} else {
+		return FALSE;
+	}
+	if (bitCount < 1 || bitCount > WIEGAND_MAX_BITS) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&ws->mutex);
+	if (!ws->threadStarted) {
+		pthread_t thread;
+		if (!setupSubsystems(SETUP_GPIO)) {
+			pthread_mutex_unlock(&ws->mutex);
+			return FALSE;
+		}
+		if (pthread_create(&thread, NULL, wiegandSender, ws) != 0) {
+			pthread_mutex_unlock(&ws->mutex);
+			return FALSE;
+		}
+		pthread_detach(thread);
+		ws->threadStarted = TRUE;
+	}
+	if (ws->size == WIEGAND_SEND_QUEUE_SIZE) {
+		pthread_mutex_unlock(&ws->mutex);
+		return FALSE;
+	}
+	int tail = (ws->head + ws->size) % WIEGAND_SEND_QUEUE_SIZE;
+	ws->data[tail] = data;
+	ws->bitCount[tail] = bitCount;
+	ws->size++;
+	pthread_cond_broadcast(&ws->cond);
+	pthread_mutex_unlock(&ws->mutex);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandSendFlush(int interface) {
+	struct WiegandSender* ws;
+	if (interface == 1) {
+		ws = &wSenders[0];
 	} else if (interface == 2) {
-		w2.run = 0;
+		ws = &wSenders[1];
 	} else {
 		return FALSE;
 	}
+	pthread_mutex_lock(&ws->mutex);
+	while (ws->threadStarted && (ws->size > 0 || ws->busy)) {
+		pthread_cond_wait(&ws->cond, &ws->mutex);
+	}
+	pthread_mutex_unlock(&ws->mutex);
 	return TRUE;
 }
@@ -27,6 +27,10 @@
 
 #include <inttypes.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define IONOPI_VERSION "1.6.4"
 
 #define TTL1	7
@@ -84,17 +88,137 @@
 #define	INT_EDGE_BOTH		3
 #endif
 
+#define IONOPI_SETUP_LED		0x01
+#define IONOPI_SETUP_OUTPUTS	0x02
+#define IONOPI_SETUP_INPUTS		0x04
+#define IONOPI_SETUP_ANALOG		0x08
+#define IONOPI_SETUP_ALL		0x0F
+
+#define IONOPI_THREAD_INTERRUPT	0
+#define IONOPI_THREAD_DEBOUNCE	1
+#define IONOPI_THREAD_WIEGAND	2
+#define IONOPI_THREAD_ANALOG	3
+#define IONOPI_THREAD_WIEGAND_OUT	4
+#define IONOPI_THREAD_CALLBACK	5
+#define IONOPI_THREAD_SCAN		6
+#define IONOPI_THREAD_REFLEX	7
+#define IONOPI_THREAD_DIGITAL	8
+#define IONOPI_THREADS			9
+
+#define IONOPI_CALLBACK_DROP_OLDEST	0
+#define IONOPI_CALLBACK_COALESCE	1
+#define IONOPI_CALLBACK_BLOCK		2
+
+#define IONOPI_REFLEX_SET		0
+#define IONOPI_REFLEX_PULSE		1
+#define IONOPI_REFLEX_TOGGLE	2
+
+struct IonoPiTimingStats {
+	unsigned long int count;
+	unsigned long int errors;
+	unsigned long int minMicros;
+	unsigned long int maxMicros;
+	unsigned long int meanMicros;
+};
+
+struct IonoPiStormStats {
+	int active;
+	unsigned long int storms;
+	unsigned long int suppressed;
+	unsigned long int summaries;
+};
+
+struct IonoPiAnalogBusStats {
+	unsigned long int requests;
+	unsigned long int cached;
+	unsigned long int merged;
+	unsigned long int conversions;
+	unsigned long int transfers;
+	unsigned long int errors;
+	unsigned long int maxBatch;
+	unsigned long int maxQueue;
+	unsigned long int meanWaitMicros;
+	unsigned long int maxWaitMicros;
+	unsigned long int meanAgeMicros;
+	unsigned long int maxAgeMicros;
+};
+
+struct IonoPiCallbackStats {
+	unsigned long int queued;
+	unsigned long int delivered;
+	unsigned long int dropped;
+	unsigned long int coalesced;
+	unsigned long int blocked;
+	unsigned long int maxDepth;
+};
+
+struct IonoPiReflexRule {
+	int input;
+	int edge;
+	int output;
+	int action;
+	int value;
+	unsigned int delayMillis;
+	unsigned int pulseMillis;
+};
+
+struct IonoPiReflexStats {
+	unsigned long int hits;
+	unsigned long int dropped;
+};
+
 extern int ionoPiSetup();
+extern int ionoPiSetupEx(int flags);
+extern int ionoPiSetRealtime(int thread, int priority, int cpu);
+extern int ionoPiLockMemory(unsigned int stackSize);
+extern int ionoPiGetTimingStats(int thread, struct IonoPiTimingStats* stats,
+		int reset);
 extern void ionoPiPinMode(int pin, int mode);
 extern void ionoPiDigitalWrite(int output, int value);
 extern void ionoPiSetDigitalDebounce(int di, int millis);
+extern int ionoPiDigitalSampling(unsigned int periodMicros);
+extern int ionoPiDigitalSampledDebounce(int di, unsigned int riseMillis,
+		unsigned int fallMillis);
+extern int ionoPiDigitalSampledDebounceDisable(int di);
 extern int ionoPiDigitalRead(int di);
+extern int ionoPiDigitalReadIndex(int index);
 extern int ionoPiAnalogRead(int ai);
+extern int ionoPiAnalogReadMany(const int* ais, int count, int* values);
 extern float ionoPiVoltageRead(int ai);
+extern float ionoPiRawToVoltage(int ai, int value);
+extern int ionoPiSetAnalogSpeed(int hz);
+extern int ionoPiGetAnalogSpeed();
+extern void ionoPiSetAnalogFreshness(unsigned int maxAgeMicros);
+extern int ionoPiGetAnalogBusStats(struct IonoPiAnalogBusStats* stats,
+		int reset);
+extern int ionoPiAnalogCalibrateSpeed(int save);
+extern int ionoPiAnalogSampling(unsigned int periodMicros);
+extern int ionoPiAnalogComparator(int ai, float lowVoltage, float highVoltage,
+		unsigned int dwellMillis, void (*callBack)(int, int, float));
+extern int ionoPiAnalogComparatorDisable(int ai);
+extern int ionoPiAnalogComparatorRead(int ai);
+extern int ionoPiAnalogComparatorFd();
 extern int ionoPiDigitalInterrupt(int di, int mode, void (*callBack)(int, int));
+extern int ionoPiDigitalStormProtection(int di, unsigned int rate,
+		unsigned int burst, unsigned int summaryMillis,
+		void (*callBack)(int, int, unsigned int));
+extern int ionoPiGetStormStats(int di, struct IonoPiStormStats* stats,
+		int reset);
+extern int ionoPiReflexRules(const struct IonoPiReflexRule* rules, int count);
+extern int ionoPiGetReflexStats(int rule, struct IonoPiReflexStats* stats,
+		int reset);
+extern int ionoPiCallbackWorkers(int workers, unsigned int queueSize,
+		int policy);
+extern int ionoPiGetCallbackStats(int di, struct IonoPiCallbackStats* stats,
+		int reset);
 extern int ionoPi1WireBusGetDevices(char*** ids);
 extern int ionoPi1WireBusReadTemperature(const char* deviceId,
 		const int attempts, int *temp);
+extern int ionoPi1WireBusGetResolution(const char* deviceId, int* bits,
+		unsigned int* convMillis);
+extern int ionoPi1WireBusSetResolution(const char* deviceId, int bits);
+extern int ionoPi1WireBusRequest(const char* deviceId, float precision,
+		unsigned int maxLatencyMillis);
 extern int ionoPi1WireMaxDetectRead(const int ttl, const int attempts,
 		int *temp, int *rh);
 extern void ionoPiSetWiegandPulse(unsigned int maxWidthMicros,
@@ -102,5 +226,161 @@ extern void ionoPiSetWiegandPulse(unsigned int maxWidthMicros,
 extern int ionoPiWiegandMonitor(int interface,
 		int (*callBack)(int, int, uint64_t));
 extern int ionoPiWiegandStop(int interface);
+extern int ionoPiWiegandSend(int interface, uint64_t data, int bitCount);
+extern int ionoPiWiegandSendFlush(int interface);
+
+struct IonoPiWiegandAccessStats {
+	unsigned long int granted;
+	unsigned long int denied;
+};
+
+extern int ionoPiWiegandAccessWrite(const char* path, const uint64_t* ids,
+		int count, int bitCount, int keyShift, int keyBits);
+extern int ionoPiWiegandAccessLoad(const char* path);
+extern int ionoPiWiegandAccessCheck(int bitCount, uint64_t data);
+extern int ionoPiWiegandAccess(int interface, int output,
+		unsigned int pulseMillis);
+extern int ionoPiGetWiegandAccessStats(int interface,
+		struct IonoPiWiegandAccessStats* stats, int reset);
+
+#define IONOPI_TRIGGER_EDGE		1
+#define IONOPI_TRIGGER_LEVEL	2
+
+/*
+ * Analog inputs samples around a trigger. tsMicros are the timestamps of the
+ * samples (us, CLOCK_MONOTONIC), values the raw values of the inputs in ais,
+ * values[i * count + j] being the value of ais[j] in sample i.
+ */
+struct IonoPiAnalogCapture {
+	int count;
+	int ais[4];
+	unsigned int samples;
+	unsigned int triggerIndex;
+	int triggerType;
+	int trigger;
+	int triggerValue;
+	uint64_t triggerMicros;
+	unsigned long int dropped;
+	const uint64_t* tsMicros;
+	const int* values;
+};
+
+extern int ionoPiAnalogCaptureSetup(const int* ais, int count,
+		unsigned int preSamples, unsigned int postSamples, int buffers);
+extern int ionoPiAnalogCaptureTriggerEdge(int di, int mode);
+extern int ionoPiAnalogCaptureTriggerLevel(int ai, float voltage, int mode);
+extern int ionoPiAnalogCaptureStop();
+extern const struct IonoPiAnalogCapture* ionoPiAnalogCaptureWait(
+		int timeoutMillis);
+extern void ionoPiAnalogCaptureRelease(const struct IonoPiAnalogCapture* cap);
+
+struct IonoPiCapture;
+
+extern struct IonoPiCapture* ionoPiCaptureCreate(const char* path,
+		const int* ais, int count, unsigned int periodMicros,
+		unsigned int chunkSamples, unsigned int flushChunks);
+extern int ionoPiCaptureWrite(struct IonoPiCapture* cap, uint64_t tsMicros,
+		const int* values);
+extern int ionoPiCaptureSample(struct IonoPiCapture* cap);
+extern int ionoPiCaptureClose(struct IonoPiCapture* cap);
+extern struct IonoPiCapture* ionoPiCaptureOpen(const char* path);
+extern int ionoPiCaptureInfo(struct IonoPiCapture* cap, int* ais, int* count,
+		unsigned int* periodMicros, uint64_t* startMicros,
+		uint64_t* endMicros);
+extern int ionoPiCaptureRead(struct IonoPiCapture* cap, uint64_t fromMicros,
+		uint64_t toMicros,
+		int (*callBack)(uint64_t tsMicros, int count, const int* values));
+
+#define IONOPI_STATS_WINDOWS_MAX	4
+#define IONOPI_STATS_MAX_1WIRE		8
+
+struct IonoPiWindowStats {
+	unsigned long int count;
+	float min;
+	float max;
+	float mean;
+	float stdDev;
+};
+
+extern int ionoPiStatsSetup(const unsigned int* windowsMillis, int count);
+extern int ionoPiStatsAnalog(int ai, int enable);
+extern int ionoPiStatsReadAnalog(int ai, int window,
+		struct IonoPiWindowStats* stats);
+extern int ionoPiStatsRead1Wire(const char* deviceId, int window,
+		struct IonoPiWindowStats* stats);
+
+#define IONOPI_SCAN_ANALOG		0x01
+
+/*
+ * Input image of a scan cycle. tsMicros is the start time of the cycle (us,
+ * CLOCK_MONOTONIC), ai the raw values of the analog inputs, only read with
+ * IONOPI_SCAN_ANALOG.
+ */
+struct IonoPiScanInputs {
+	uint64_t cycle;
+	uint64_t tsMicros;
+	int di[6];
+	int ttl[4];
+	int ai[4];
+};
+
+struct IonoPiScanOutputs {
+	int o[4];
+	int oc[3];
+	int led;
+};
+
+struct IonoPiScanStats {
+	unsigned long int cycles;
+	unsigned long int overruns;
+	unsigned long int minCycleMicros;
+	unsigned long int maxCycleMicros;
+	unsigned long int meanCycleMicros;
+	unsigned long int maxJitterMicros;
+	unsigned long int meanJitterMicros;
+};
+
+extern int ionoPiScanCycle(unsigned int periodMicros, int flags,
+		int (*logic)(const struct IonoPiScanInputs* in,
+				struct IonoPiScanOutputs* out, void* arg), void* arg);
+extern int ionoPiScanCycleStop();
+extern int ionoPiGetScanStats(struct IonoPiScanStats* stats, int reset);
+
+#define IONOPI_STATE_NAME			"/ionopi"
+#define IONOPI_STATE_MAX_1WIRE		8
+
+/*
+ * I/O state published in shared memory. Timestamps are in us from
+ * CLOCK_MONOTONIC, temperatures in millis of °C.
+ */
+struct IonoPiState {
+	uint32_t seq;
+	uint32_t oneWireCount;
+	uint64_t ts;
+	int32_t di[6];
+	int32_t ttl[4];
+	int32_t o[4];
+	int32_t oc[3];
+	int32_t led;
+	int32_t ai[4];
+	uint64_t aiTs;
+	char oneWireIds[IONOPI_STATE_MAX_1WIRE][20];
+	int32_t oneWireTemp[IONOPI_STATE_MAX_1WIRE];
+	uint64_t oneWireTs[IONOPI_STATE_MAX_1WIRE];
+};
+
+struct IonoPiStateShm;
+
+extern int ionoPiStatePublish(const char* name, unsigned int periodMillis,
+		unsigned int oneWirePeriodMillis);
+extern int ionoPiStatePublishStop();
+extern struct IonoPiStateShm* ionoPiStateOpen(const char* name);
+extern int ionoPiStateRead(struct IonoPiStateShm* shm,
+		struct IonoPiState* state);
+extern void ionoPiStateClose(struct IonoPiStateShm* shm);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* IONOPI_H_INCLUDED */
@@ -0,0 +1,390 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Optional C++17 wrapper of the ionoPi library.
+ *
+ * Pins are types: the pin is a template parameter checked at compile time,
+ * so using a relay as an input or an analog input as a relay does not
+ * compile, and the pin-to-input mapping is resolved by the compiler.
+ * Interrupt callbacks and Wiegand monitors are RAII handles, unregistered
+ * when they go out of scope.
+ *
+ *     ionopi::Input<DI1, 20> button;          // 20 ms debounce
+ *     ionopi::Relay<O2> relay;
+ *     auto h = button.onEdge<ionopi::Edge::Rising>([&](bool) {
+ *         relay.toggle();
+ *     });
+ */
+
+#ifndef IONOPI_HPP_INCLUDED
+#define IONOPI_HPP_INCLUDED
+
+#include "ionoPi.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace ionopi {
+
+enum class Edge {
+	Falling = INT_EDGE_FALLING, Rising = INT_EDGE_RISING, Both = INT_EDGE_BOTH
+};
+
+namespace detail {
+
+/*
+ * Index of a digital input in the library tables, -1 if not an input.
+ */
+constexpr int inputIndex(int pin) {
+	switch (pin) {
+	case DI1:
+		return 0;
+	case DI2:
+		return 1;
+	case DI3:
+		return 2;
+	case DI4:
+		return 3;
+	case DI5:
+		return 4;
+	case DI6:
+		return 5;
+	case TTL1:
+		return 6;
+	case TTL2:
+		return 7;
+	case TTL3:
+		return 8;
+	case TTL4:
+		return 9;
+	default:
+		return -1;
+	}
+}
+
+constexpr bool isRelay(int pin) {
+	return pin == O1 || pin == O2 || pin == O3 || pin == O4;
+}
+
+constexpr bool isOpenCollector(int pin) {
+	return pin == OC1 || pin == OC2 || pin == OC3;
+}
+
+constexpr bool isAnalogInput(int ai) {
+	return ai == AI1 || ai == AI2 || ai == AI3 || ai == AI4;
+}
+
+/*
+ * Type-erased call of a handle: fn is instantiated for the type of self,
+ * so a late call never sees a handle of another type.
+ */
+template<class Sig>
+struct Invoker;
+
+template<class R, class ... Args>
+struct Invoker<R(Args...)> {
+	R (*fn)(void*, Args...);
+	void* self;
+};
+
+/*
+ * Callback of the handle currently registered on a pin or interface. The
+ * callers count is used to wait for running calls when unregistering.
+ */
+template<int Key, class Sig>
+struct Slot;
+
+template<int Key, class R, class ... Args>
+struct Slot<Key, R(Args...)> {
+	using Invoker = detail::Invoker<R(Args...)>;
+
+	static inline std::atomic<Invoker*> handle { nullptr };
+	static inline std::atomic<int> callers { 0 };
+
+	static bool acquire(Invoker* h) {
+		Invoker* expected = nullptr;
+		return handle.compare_exchange_strong(expected, h);
+	}
+
+	static void release() {
+		handle.store(nullptr);
+		while (callers.load() != 0) {
+			std::this_thread::yield();
+		}
+	}
+
+	static R call(Args ... args) {
+		callers.fetch_add(1);
+		Invoker* h = handle.load();
+		if constexpr (std::is_void_v<R>) {
+			if (h != nullptr) {
+				h->fn(h->self, args...);
+			}
+			callers.fetch_sub(1);
+		} else {
+			R res = h != nullptr ? h->fn(h->self, args...) : R();
+			callers.fetch_sub(1);
+			return res;
+		}
+	}
+};
+
+} // namespace detail
+
+/*
+ * Callback registration on a digital input, see ionoPiDigitalInterrupt().
+ * Only one handle per input can be active, check ok() after construction.
+ * The destructor unregisters the callback and waits for running calls.
+ */
+template<int Pin, Edge E, class F>
+class Interrupt {
+	static_assert(detail::inputIndex(Pin) >= 0, "not a digital input");
+
+	using Slot = detail::Slot<Pin, void(int)>;
+
+public:
+	explicit Interrupt(F f) :
+			f(std::move(f)), invoker { &Interrupt::invoke, this } {
+		registered = Slot::acquire(&invoker);
+		if (registered && !ionoPiDigitalInterrupt(Pin, static_cast<int>(E),
+				&Interrupt::callBack)) {
+			Slot::release();
+			registered = false;
+		}
+	}
+
+	Interrupt(const Interrupt&) = delete;
+	Interrupt& operator=(const Interrupt&) = delete;
+
+	~Interrupt() {
+		if (registered) {
+			ionoPiDigitalInterrupt(Pin, static_cast<int>(E), nullptr);
+			Slot::release();
+		}
+	}
+
+	bool ok() const {
+		return registered;
+	}
+
+private:
+	static void invoke(void* self, int value) {
+		static_cast<Interrupt*>(self)->f(value == HIGH);
+	}
+
+	static void callBack(int, int value) {
+		Slot::call(value);
+	}
+
+	F f;
+	typename Slot::Invoker invoker;
+	bool registered;
+};
+
+/*
+ * Digital input DI1..DI6 or TTL1..TTL4, with an optional debounce time set
+ * on construction.
+ */
+template<int Pin, unsigned int DebounceMillis = 0>
+class Input {
+	static_assert(detail::inputIndex(Pin) >= 0, "not a digital input");
+
+public:
+	static constexpr int pin = Pin;
+	static constexpr int index = detail::inputIndex(Pin);
+
+	Input() {
+		if constexpr (DebounceMillis > 0) {
+			ionoPiSetDigitalDebounce(Pin, DebounceMillis);
+		}
+	}
+
+	bool read() const {
+		return ionoPiDigitalReadIndex(index) == HIGH;
+	}
+
+	template<Edge E = Edge::Both, class F>
+	Interrupt<Pin, E, F> onEdge(F f) const {
+		return Interrupt<Pin, E, F>(std::move(f));
+	}
+};
+
+/*
+ * Output pin, see Relay, OpenCollector and Led.
+ */
+template<int Pin>
+class Output {
+public:
+	static constexpr int pin = Pin;
+
+	void write(bool value) const {
+		ionoPiDigitalWrite(Pin, value ? HIGH : LOW);
+	}
+
+	bool read() const {
+		return ionoPiDigitalRead(Pin) == HIGH;
+	}
+
+	void toggle() const {
+		write(!read());
+	}
+};
+
+template<int Pin>
+class Relay: public Output<Pin> {
+	static_assert(detail::isRelay(Pin), "not a relay output");
+
+public:
+	void close() const {
+		this->write(true);
+	}
+
+	void open() const {
+		this->write(false);
+	}
+};
+
+template<int Pin>
+class OpenCollector: public Output<Pin> {
+	static_assert(detail::isOpenCollector(Pin), "not an open collector");
+
+public:
+	void close() const {
+		this->write(true);
+	}
+
+	void open() const {
+		this->write(false);
+	}
+};
+
+class Led: public Output<LED> {
+public:
+	void on() const {
+		write(true);
+	}
+
+	void off() const {
+		write(false);
+	}
+};
+
+/*
+ * Analog input AI1..AI4.
+ */
+template<int Ai>
+class AnalogInput {
+	static_assert(detail::isAnalogInput(Ai), "not an analog input");
+
+public:
+	static constexpr int ai = Ai;
+
+	int readRaw() const {
+		return ionoPiAnalogRead(Ai);
+	}
+
+	float readVoltage() const {
+		return ionoPiVoltageRead(Ai);
+	}
+
+	float toVoltage(int raw) const {
+		return ionoPiRawToVoltage(Ai, raw);
+	}
+};
+
+/*
+ * Monitor of Wiegand interface 1 or 2 running on its own thread, see
+ * ionoPiWiegandMonitor(). The callable is called with the number of bits
+ * and the data of each frame. Only one handle per interface can be active,
+ * check ok() after construction. The destructor stops the monitor and
+ * waits for its thread.
+ */
+template<int Interface, class F>
+class WiegandMonitor {
+	static_assert(Interface == 1 || Interface == 2,
+			"not a Wiegand interface");
+
+	using Slot = detail::Slot<-Interface, int(int, uint64_t)>;
+
+public:
+	explicit WiegandMonitor(F f) :
+			f(std::move(f)), invoker { &WiegandMonitor::invoke, this },
+			running(true) {
+		registered = Slot::acquire(&invoker);
+		if (registered) {
+			thread = std::thread([this] {
+				ionoPiWiegandMonitor(Interface, &WiegandMonitor::callBack);
+				running.store(false);
+			});
+		}
+	}
+
+	WiegandMonitor(const WiegandMonitor&) = delete;
+	WiegandMonitor& operator=(const WiegandMonitor&) = delete;
+
+	~WiegandMonitor() {
+		if (registered) {
+			// the monitor may not have started yet
+			while (running.load()) {
+				ionoPiWiegandStop(Interface);
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			thread.join();
+			Slot::release();
+		}
+	}
+
+	bool ok() const {
+		return registered;
+	}
+
+private:
+	static int invoke(void* self, int bitCount, uint64_t data) {
+		static_cast<WiegandMonitor*>(self)->f(bitCount, data);
+		return TRUE;
+	}
+
+	static int callBack(int, int bitCount, uint64_t data) {
+		return Slot::call(bitCount, data);
+	}
+
+	F f;
+	typename Slot::Invoker invoker;
+	std::atomic<bool> running;
+	bool registered;
+	std::thread thread;
+};
+
+template<int Interface, class F>
+WiegandMonitor<Interface, F> monitorWiegand(F f) {
+	return WiegandMonitor<Interface, F>(std::move(f));
+}
+
+} // namespace ionopi
+
+#endif /* IONOPI_HPP_INCLUDED */
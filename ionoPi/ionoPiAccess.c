@@ -0,0 +1,283 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Whitelist of the Wiegand frames granting access.
+ *
+ * The list is stored in a file as an open addressing hash table with
+ * linear probing and a load factor of at most 1/2, which is memory-mapped
+ * and searched in place, so loading it costs no parsing nor allocations
+ * proportional to its size. The current table is swapped atomically; the
+ * readers only increment a counter while searching it, and the previous
+ * table is unmapped once the counter drops to zero.
+ */
+
+#include "ionoPi.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ACCESS_MAGIC			0x4957504F
+#define ACCESS_VERSION			2
+#define ACCESS_SLOT_EMPTY		UINT64_MAX
+
+struct AccessHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t bitCount;
+	uint8_t keyShift;
+	uint8_t keyBits;
+	uint8_t reserved[3];
+	uint32_t count;
+	uint32_t slots;
+	/* for the alignment of the slots */
+	uint32_t reserved2;
+};
+
+struct AccessTable {
+	void* map;
+	size_t size;
+	struct AccessHeader header;
+	const uint64_t* slots;
+};
+
+_Atomic(struct AccessTable*) accessTable = NULL;
+atomic_int accessReaders = 0;
+
+/*
+ *
+ */
+static uint64_t accessHash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	key *= 0xC4CEB9FE1A85EC53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+/*
+ * Extracts the key, e.g. the card number without facility code and parity
+ * bits, from a frame.
+ */
+static int accessKey(const struct AccessHeader* h, int bitCount, uint64_t data,
+		uint64_t* key) {
+	if (h->bitCount != 0 && h->bitCount != bitCount) {
+		return FALSE;
+	}
+	data >>= h->keyShift;
+	if (h->keyBits < 64) {
+		data &= (1ULL << h->keyBits) - 1;
+	}
+	*key = data;
+	return TRUE;
+}
+
+/*
+ *
+ */
+static int accessFind(const struct AccessTable* t, uint64_t key) {
+	uint32_t mask = t->header.slots - 1;
+	uint32_t i = accessHash(key) & mask;
+	uint32_t n;
+	// bounded, a corrupt file may have no empty slot
+	for (n = 0; n < t->header.slots && t->slots[i] != ACCESS_SLOT_EMPTY;
+			n++) {
+		if (t->slots[i] == key) {
+			return TRUE;
+		}
+		i = (i + 1) & mask;
+	}
+	return FALSE;
+}
+
+/*
+ *
+ */
+static void accessTableFree(struct AccessTable* t) {
+	if (t != NULL) {
+		munmap(t->map, t->size);
+		free(t);
+	}
+}
+
+/*
+ * Called by the access threads for each frame received.
+ */
+int accessTableMatch(int bitCount, uint64_t data) {
+	struct AccessTable* t;
+	uint64_t key;
+	int found = FALSE;
+
+	atomic_fetch_add(&accessReaders, 1);
+	t = atomic_load(&accessTable);
+	if (t != NULL && accessKey(&t->header, bitCount, data, &key)) {
+		found = accessFind(t, key);
+	}
+	atomic_fetch_sub(&accessReaders, 1);
+	return found;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandAccessWrite(const char* path, const uint64_t* ids, int count,
+		int bitCount, int keyShift, int keyBits) {
+	struct AccessHeader h;
+	uint64_t* slots;
+	uint32_t i, j, mask;
+	char tmpPath[PATH_MAX];
+	int fd, ok;
+
+	if (path == NULL || count < 0 || (count > 0 && ids == NULL)
+			|| bitCount < 0 || bitCount > 64 || keyShift < 0 || keyShift > 63
+			|| keyBits < 1 || keyBits > 64 || count > 0x40000000) {
+		return FALSE;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = ACCESS_MAGIC;
+	h.version = ACCESS_VERSION;
+	h.bitCount = bitCount;
+	h.keyShift = keyShift;
+	h.keyBits = keyBits;
+	h.slots = 2;
+	while (h.slots < (uint32_t) count * 2) {
+		h.slots <<= 1;
+	}
+	mask = h.slots - 1;
+
+	slots = malloc(h.slots * sizeof(uint64_t));
+	if (slots == NULL) {
+		return FALSE;
+	}
+	memset(slots, 0xFF, h.slots * sizeof(uint64_t));
+	for (i = 0; i < (uint32_t) count; i++) {
+		if (ids[i] == ACCESS_SLOT_EMPTY || (keyBits < 64
+				&& ids[i] >= (1ULL << keyBits))) {
+			free(slots);
+			return FALSE;
+		}
+		j = accessHash(ids[i]) & mask;
+		while (slots[j] != ACCESS_SLOT_EMPTY && slots[j] != ids[i]) {
+			j = (j + 1) & mask;
+		}
+		if (slots[j] == ACCESS_SLOT_EMPTY) {
+			slots[j] = ids[i];
+			h.count++;
+		}
+	}
+
+	// written aside and renamed, so that a loaded table is never modified
+	if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path)
+			>= (int) sizeof(tmpPath)) {
+		free(slots);
+		return FALSE;
+	}
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(slots);
+		return FALSE;
+	}
+	ok = write(fd, &h, sizeof(h)) == sizeof(h)
+			&& write(fd, slots, h.slots * sizeof(uint64_t))
+					== (ssize_t) (h.slots * sizeof(uint64_t))
+			&& fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	free(slots);
+	if (!ok || rename(tmpPath, path) != 0) {
+		unlink(tmpPath);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandAccessLoad(const char* path) {
+	struct AccessTable* t = NULL;
+	struct AccessTable* old;
+	struct stat st;
+
+	if (path != NULL) {
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return FALSE;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(t->header)) {
+			close(fd);
+			return FALSE;
+		}
+		t = malloc(sizeof(struct AccessTable));
+		if (t == NULL) {
+			close(fd);
+			return FALSE;
+		}
+		t->size = st.st_size;
+		t->map = mmap(NULL, t->size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd,
+				0);
+		close(fd);
+		if (t->map == MAP_FAILED) {
+			free(t);
+			return FALSE;
+		}
+		memcpy(&t->header, t->map, sizeof(t->header));
+		t->slots = (const uint64_t*) ((char*) t->map + sizeof(t->header));
+		if (t->header.magic != ACCESS_MAGIC
+				|| t->header.version != ACCESS_VERSION
+				|| t->header.bitCount > 64 || t->header.keyShift > 63
+				|| t->header.keyBits < 1 || t->header.keyBits > 64
+				|| t->header.slots < 2
+				|| (t->header.slots & (t->header.slots - 1)) != 0
+				|| t->header.count >= t->header.slots
+				|| t->size < sizeof(t->header)
+						+ (size_t) t->header.slots * sizeof(uint64_t)) {
+			accessTableFree(t);
+			return FALSE;
+		}
+	}
+
+	old = atomic_exchange(&accessTable, t);
+	// readers that may still be using the previous table
+	while (atomic_load(&accessReaders) != 0) {
+		usleep(100);
+	}
+	accessTableFree(old);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiWiegandAccessCheck(int bitCount, uint64_t data) {
+	return accessTableMatch(bitCount, data);
+}
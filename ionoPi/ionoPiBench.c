@@ -0,0 +1,319 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Micro-benchmarks of the CPU-bound paths of the library.
+ *
+ * ionoPi.c is compiled into this program with the wiringPi functions
+ * replaced by the stubs below, so that it runs on any Linux machine, and
+ * malloc() and friends are wrapped to count the allocations. nanosleep(),
+ * used by wData() to wait for the pulse width, returns immediately so that
+ * only the decoding is measured. Each benchmark
+ * is run with an increasing number of iterations until it takes at least
+ * the target time, then repeated and the median is reported.
+ *
+ * Usage: ionoPiBench [-t <ms>] [-r <runs>] [<name filter>]
+ */
+
+#include "ionoPi.c"
+
+#define BENCH_TARGET_MS		200
+#define BENCH_RUNS			5
+#define BENCH_MAX_RUNS		31
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+atomic_ulong benchAllocs = 0;
+
+volatile int benchSink;
+
+unsigned char benchRht03[4];
+char benchW1Path[64];
+
+/* wiringPi stubs */
+
+int wiringPiSetup(void) {
+	return 0;
+}
+
+void pinMode(int pin, int mode) {
+}
+
+void pullUpDnControl(int pin, int pud) {
+}
+
+int digitalRead(int pin) {
+	return HIGH;
+}
+
+void digitalWrite(int pin, int value) {
+}
+
+int wiringPiISR(int pin, int mode, void (*function)(void)) {
+	return 0;
+}
+
+void delay(unsigned int howLong) {
+}
+
+int wpiPinToGpio(int wpiPin) {
+	return -1;
+}
+
+int wiringPiSPISetup(int channel, int speed) {
+	return -1;
+}
+
+int wiringPiSPIGetFd(int channel) {
+	return -1;
+}
+
+int maxDetectRead(const int pin, unsigned char buffer[4]) {
+	memcpy(buffer, benchRht03, 4);
+	return TRUE;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+	return 0;
+}
+
+/* ionoPiAccess.c and ionoPiStats.c stubs */
+
+int accessTableMatch(int bitCount, uint64_t data) {
+	return FALSE;
+}
+
+atomic_int statsAnalogEnabled[4];
+
+void statsAnalogAdd(int index, int raw) {
+}
+
+void stats1WireAdd(const char* deviceId, int temp) {
+}
+
+/* allocation counters */
+
+void *malloc(size_t size) {
+	atomic_fetch_add_explicit(&benchAllocs, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	atomic_fetch_add_explicit(&benchAllocs, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	atomic_fetch_add_explicit(&benchAllocs, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/* benchmarks */
+
+void bench1WireParse(unsigned long int n) {
+	int temp;
+	while (n-- > 0) {
+		benchSink = read1WireBusDevice(benchW1Path, &temp);
+	}
+}
+
+void benchRht03Decode(unsigned long int n) {
+	int temp, rh;
+	while (n-- > 0) {
+		benchRht03[2] = (n & 1) ? 0x80 : 0x00;
+		benchSink = readRHT03Fixed(TTL1, &temp, &rh) + temp + rh;
+	}
+}
+
+void benchWiegandBits(unsigned long int n) {
+	ionoPiSetWiegandPulse(0, 0, UINT_MAX);
+	while (n-- > 0) {
+		wData(&w1, TTL1, n & 1);
+		if (ATOMIC_GET(w1.bitCount) == 26) {
+			// frame taken by the monitor
+			ATOMIC_SET(w1.deliveredSeq, atomic_load(&w1.seq));
+		}
+	}
+}
+
+void benchWiegandReject(unsigned long int n) {
+	ionoPiSetWiegandPulse(0, UINT_MAX, UINT_MAX);
+	while (n-- > 0) {
+		wData(&w1, TTL1, n & 1);
+	}
+}
+
+void benchDiffUsec(unsigned long int n) {
+	struct timespec t1 = { 1000, 999999000 };
+	struct timespec t2 = { 1001, 1000 };
+	while (n-- > 0) {
+		t2.tv_nsec = n % 1000000000L;
+		benchSink = diff_usec(&t1, &t2);
+	}
+}
+
+void benchVoltage(unsigned long int n) {
+	float v = 0;
+	while (n-- > 0) {
+		v += ionoPiRawToVoltage((n & 1) ? AI1 : AI3, n & 0xFFF);
+	}
+	benchSink = (int) v;
+}
+
+void benchVoltageToRaw(unsigned long int n) {
+	int raw = 0;
+	while (n-- > 0) {
+		raw += voltageToRaw((n & 1) ? AI1 : AI3, (n & 0xFFF) * 0.01f);
+	}
+	benchSink = raw;
+}
+
+struct Bench {
+	const char* name;
+	void (*run)(unsigned long int n);
+} benches[] = {
+	{ "1wire_parse", bench1WireParse },
+	{ "rht03_decode", benchRht03Decode },
+	{ "wiegand_bit", benchWiegandBits },
+	{ "wiegand_bit_reject", benchWiegandReject },
+	{ "diff_usec", benchDiffUsec },
+	{ "raw_to_voltage", benchVoltage },
+	{ "voltage_to_raw", benchVoltageToRaw },
+};
+
+/*
+ *
+ */
+unsigned long int benchNanos(struct Bench* b, unsigned long int n,
+		unsigned long int* allocs) {
+	struct timespec start, end;
+	unsigned long int a = atomic_load(&benchAllocs);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	b->run(n);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*allocs = atomic_load(&benchAllocs) - a;
+	return (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec
+			- start.tv_nsec;
+}
+
+/*
+ *
+ */
+int compareDouble(const void* a, const void* b) {
+	double da = *(const double*) a, db = *(const double*) b;
+	return (da > db) - (da < db);
+}
+
+/*
+ *
+ */
+int main(int argc, char *argv[]) {
+	unsigned long int targetNanos = BENCH_TARGET_MS * 1000000UL;
+	unsigned long int n, nanos, allocs;
+	double nsPerOp[BENCH_MAX_RUNS], allocsPerOp = 0;
+	int runs = BENCH_RUNS;
+	const char* filter = NULL;
+	unsigned int i;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "t:r:")) != -1) {
+		switch (opt) {
+		case 't':
+			targetNanos = strtoul(optarg, NULL, 10) * 1000000UL;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+					"Usage: %s [-t <ms>] [-r <runs>] [<name filter>]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1 || runs > BENCH_MAX_RUNS) {
+		runs = BENCH_RUNS;
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	snprintf(benchW1Path, sizeof(benchW1Path), "/tmp/ionoPiBench-XXXXXX");
+	int fd = mkstemp(benchW1Path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	const char* w1Slave = "72 01 4b 46 7f ff 0e 10 57 : crc=57 YES\n"
+			"72 01 4b 46 7f ff 0e 10 57 t=23125\n";
+	if (write(fd, w1Slave, strlen(w1Slave)) < 0) {
+		perror("write");
+		return 1;
+	}
+	close(fd);
+
+	benchRht03[0] = 0x02;
+	benchRht03[1] = 0x8C;
+	benchRht03[3] = 0x5F;
+	ATOMIC_SET(w1.run, TRUE);
+
+	printf("%-20s %12s %12s %12s\n", "benchmark", "iterations", "ns/op",
+			"allocs/op");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		struct Bench* b = &benches[i];
+		if (filter != NULL && strstr(b->name, filter) == NULL) {
+			continue;
+		}
+
+		// warm up and find the iterations count for the target time
+		n = 1;
+		while ((nanos = benchNanos(b, n, &allocs)) < targetNanos / 2
+				&& n < ULONG_MAX / 4) {
+			n *= 2;
+		}
+		if (nanos > 0 && nanos < targetNanos) {
+			n = n * (double) targetNanos / nanos;
+		}
+
+		for (r = 0; r < runs; r++) {
+			nanos = benchNanos(b, n, &allocs);
+			nsPerOp[r] = (double) nanos / n;
+			allocsPerOp = (double) allocs / n;
+		}
+		qsort(nsPerOp, runs, sizeof(double), compareDouble);
+		printf("%-20s %12lu %12.1f %12.2f\n", b->name, n, nsPerOp[runs / 2],
+				allocsPerOp);
+	}
+
+	unlink(benchW1Path);
+	return 0;
+}
@@ -0,0 +1,719 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+/*
+ * Capture files of raw A/D readings.
+ *
+ * All values are little-endian. The file starts with a header:
+ *
+ *   0  magic "IONOCAP" + version (8 bytes)
+ *   8  number of channels (u8), channels as analog input number 1..4 (4 x u8)
+ *   16 nominal sampling period in us (u32)
+ *   20 samples per chunk (u32)
+ *   24 index offset (u64), 0 if the file was not closed
+ *   32 number of chunks (u32)
+ *
+ * followed by the chunks. Each chunk holds up to "samples per chunk"
+ * samples of all the channels:
+ *
+ *   0  magic "CHNK" (4 bytes)
+ *   4  timestamp of the first sample in us (u64)
+ *   12 timestamp of the last sample in us (u64)
+ *   20 number of samples (u32)
+ *   24 payload size in bytes (u32)
+ *   28 for each channel: first value (u16), delta bit width (u8)
+ *   +0 timestamp delta bit width (u8)
+ *
+ * The payload is a bit stream (LSB first) with, for each channel in turn,
+ * the zigzag-encoded deltas between consecutive values, each stored on the
+ * channel's bit width (at most 13), followed by the zigzag-encoded
+ * deviations of the intervals between consecutive timestamps from the
+ * nominal period, each stored on the timestamp bit width (at most 32). A
+ * sample whose deviation does not fit in 32 bits starts a new chunk.
+ *
+ * On close the index, with an entry per chunk (first and last timestamp,
+ * offset, number of samples), is appended and its offset written in the
+ * header. A reader maps the file and bisects the index to seek to any time;
+ * if the index is missing it is rebuilt scanning the chunk headers.
+ */
+
+#include "ionoPi.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_MAGIC				"IONOCAP2"
+#define CAPTURE_CHUNK_MAGIC			"CHNK"
+#define CAPTURE_HEADER_SIZE			64
+#define CAPTURE_CHUNK_HEADER_SIZE	28
+#define CAPTURE_INDEX_ENTRY_SIZE	32
+#define CAPTURE_MAX_CHANNELS		4
+#define CAPTURE_MAX_VALUE_WIDTH		13
+#define CAPTURE_MAX_TIME_WIDTH		32
+
+struct CaptureIndexEntry {
+	uint64_t t0;
+	uint64_t t1;
+	uint64_t offset;
+	uint32_t samples;
+};
+
+struct IonoPiCapture {
+	int count;
+	int ais[CAPTURE_MAX_CHANNELS];
+	unsigned int periodMicros;
+	unsigned int chunkSamples;
+
+	/* writer */
+	FILE *fp;
+	int writing;
+	unsigned int flushChunks;
+	unsigned int unflushedChunks;
+	uint16_t *values;
+	uint64_t *times;
+	unsigned int samples;
+	uint64_t offset;
+	unsigned char *chunkBuf;
+
+	/* writer and reader */
+	struct CaptureIndexEntry *index;
+	unsigned int chunks;
+	unsigned int indexSize;
+
+	/* reader */
+	const unsigned char *map;
+	size_t mapSize;
+};
+
+/*
+ *
+ */
+static void putLE(unsigned char *buf, uint64_t val, int bytes) {
+	int i;
+	for (i = 0; i < bytes; i++) {
+		buf[i] = (val >> (8 * i)) & 0xFF;
+	}
+}
+
+/*
+ *
+ */
+static uint64_t getLE(const unsigned char *buf, int bytes) {
+	uint64_t val = 0;
+	int i;
+	for (i = bytes - 1; i >= 0; i--) {
+		val = (val << 8) | buf[i];
+	}
+	return val;
+}
+
+/*
+ *
+ */
+static int aiNumber(int ai) {
+	switch (ai) {
+	case AI1:
+		return 1;
+	case AI2:
+		return 2;
+	case AI3:
+		return 3;
+	case AI4:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/*
+ *
+ */
+static int aiFromNumber(int n) {
+	static const int ais[] = { AI1, AI2, AI3, AI4 };
+	return ais[n - 1];
+}
+
+/*
+ *
+ */
+static size_t chunkHeaderSize(struct IonoPiCapture *cap) {
+	return CAPTURE_CHUNK_HEADER_SIZE + cap->count * 3 + 1;
+}
+
+/*
+ * Returns the zigzag encoding of the deviation from the nominal period of
+ * the interval between the given timestamps.
+ */
+static uint32_t timeDeviation(struct IonoPiCapture *cap, uint64_t prev,
+		uint64_t ts) {
+	int32_t d = (int32_t) (ts - prev - cap->periodMicros);
+	return ((uint32_t) d << 1) ^ (d >> 31);
+}
+
+/*
+ * Returns TRUE if the deviation of the given interval from the nominal
+ * period can be encoded.
+ */
+static int timeDeviationFits(struct IonoPiCapture *cap, uint64_t prev,
+		uint64_t ts) {
+	int64_t d = (int64_t) (ts - prev - cap->periodMicros);
+	return d >= INT32_MIN && d <= INT32_MAX;
+}
+
+/*
+ * Appends the given number of bits of val to the bit stream.
+ */
+static void putBits(unsigned char **p, uint64_t *acc, int *accBits,
+		uint32_t val, int bits) {
+	*acc |= (uint64_t) val << *accBits;
+	*accBits += bits;
+	while (*accBits >= 8) {
+		*(*p)++ = *acc & 0xFF;
+		*acc >>= 8;
+		*accBits -= 8;
+	}
+}
+
+/*
+ * Reads the given number of bits from the bit stream at bit offset *bit.
+ */
+static uint32_t getBits(const unsigned char *payload, size_t *bit, int bits) {
+	uint32_t val = 0;
+	int b;
+	for (b = 0; b < bits; b++) {
+		val |= (uint32_t) ((payload[*bit >> 3] >> (*bit & 7)) & 1) << b;
+		(*bit)++;
+	}
+	return val;
+}
+
+/*
+ *
+ */
+static int indexAppend(struct IonoPiCapture *cap, uint64_t t0, uint64_t t1,
+		uint64_t offset, uint32_t samples) {
+	if (cap->chunks == cap->indexSize) {
+		unsigned int size = cap->indexSize == 0 ? 64 : cap->indexSize * 2;
+		struct CaptureIndexEntry *index = realloc(cap->index,
+				size * sizeof(struct CaptureIndexEntry));
+		if (index == NULL) {
+			return FALSE;
+		}
+		cap->index = index;
+		cap->indexSize = size;
+	}
+	cap->index[cap->chunks].t0 = t0;
+	cap->index[cap->chunks].t1 = t1;
+	cap->index[cap->chunks].offset = offset;
+	cap->index[cap->chunks].samples = samples;
+	cap->chunks++;
+	return TRUE;
+}
+
+/*
+ *
+ */
+static int writeHeader(struct IonoPiCapture *cap, uint64_t indexOffset) {
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	int i;
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 8);
+	header[8] = cap->count;
+	for (i = 0; i < cap->count; i++) {
+		header[9 + i] = aiNumber(cap->ais[i]);
+	}
+	putLE(header + 16, cap->periodMicros, 4);
+	putLE(header + 20, cap->chunkSamples, 4);
+	putLE(header + 24, indexOffset, 8);
+	putLE(header + 32, cap->chunks, 4);
+	return fwrite(header, sizeof(header), 1, cap->fp) == 1;
+}
+
+/*
+ * Flushes the stdio buffer and the file data to the storage.
+ */
+static int syncFile(struct IonoPiCapture *cap) {
+	if (fflush(cap->fp) != 0) {
+		return FALSE;
+	}
+	cap->unflushedChunks = 0;
+	return fdatasync(fileno(cap->fp)) == 0;
+}
+
+/*
+ *
+ */
+static int writeChunk(struct IonoPiCapture *cap) {
+	unsigned char *buf = cap->chunkBuf;
+	unsigned int n = cap->samples;
+	int widths[CAPTURE_MAX_CHANNELS];
+	int timeWidth;
+	uint32_t maxTimeZz = 0;
+	unsigned int i;
+	int c;
+
+	if (n == 0) {
+		return TRUE;
+	}
+
+	memcpy(buf, CAPTURE_CHUNK_MAGIC, 4);
+	putLE(buf + 4, cap->times[0], 8);
+	putLE(buf + 12, cap->times[n - 1], 8);
+	putLE(buf + 20, n, 4);
+
+	unsigned char *p = buf + CAPTURE_CHUNK_HEADER_SIZE;
+	for (c = 0; c < cap->count; c++) {
+		const uint16_t *v = cap->values + c * cap->chunkSamples;
+		unsigned int maxZz = 0;
+		for (i = 1; i < n; i++) {
+			int d = (int) v[i] - (int) v[i - 1];
+			unsigned int zz = ((unsigned int) d << 1) ^ (d >> 31);
+			if (zz > maxZz) {
+				maxZz = zz;
+			}
+		}
+		widths[c] = 0;
+		while (maxZz >> widths[c]) {
+			widths[c]++;
+		}
+		putLE(p, v[0], 2);
+		p[2] = widths[c];
+		p += 3;
+	}
+	for (i = 1; i < n; i++) {
+		uint32_t zz = timeDeviation(cap, cap->times[i - 1], cap->times[i]);
+		if (zz > maxTimeZz) {
+			maxTimeZz = zz;
+		}
+	}
+	timeWidth = 0;
+	while (timeWidth < CAPTURE_MAX_TIME_WIDTH && (maxTimeZz >> timeWidth)) {
+		timeWidth++;
+	}
+	*p++ = timeWidth;
+
+	unsigned char *payload = p;
+	uint64_t acc = 0;
+	int accBits = 0;
+	for (c = 0; c < cap->count; c++) {
+		const uint16_t *v = cap->values + c * cap->chunkSamples;
+		if (widths[c] == 0) {
+			continue;
+		}
+		for (i = 1; i < n; i++) {
+			int d = (int) v[i] - (int) v[i - 1];
+			unsigned int zz = ((unsigned int) d << 1) ^ (d >> 31);
+			putBits(&p, &acc, &accBits, zz, widths[c]);
+		}
+	}
+	if (timeWidth > 0) {
+		for (i = 1; i < n; i++) {
+			putBits(&p, &acc, &accBits,
+					timeDeviation(cap, cap->times[i - 1], cap->times[i]),
+					timeWidth);
+		}
+	}
+	if (accBits > 0) {
+		*p++ = acc & 0xFF;
+	}
+	putLE(buf + 24, p - payload, 4);
+
+	size_t size = p - buf;
+	if (fwrite(buf, size, 1, cap->fp) != 1) {
+		return FALSE;
+	}
+	if (!indexAppend(cap, cap->times[0], cap->times[n - 1], cap->offset, n)) {
+		return FALSE;
+	}
+	cap->offset += size;
+	cap->samples = 0;
+
+	if (++cap->unflushedChunks >= cap->flushChunks) {
+		return syncFile(cap);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+static void captureFree(struct IonoPiCapture *cap) {
+	if (cap->map != NULL) {
+		munmap((void *) cap->map, cap->mapSize);
+	}
+	free(cap->values);
+	free(cap->times);
+	free(cap->chunkBuf);
+	free(cap->index);
+	free(cap);
+}
+
+/*
+ *
+ */
+struct IonoPiCapture* ionoPiCaptureCreate(const char* path, const int* ais,
+		int count, unsigned int periodMicros, unsigned int chunkSamples,
+		unsigned int flushChunks) {
+	int i;
+	if (count < 1 || count > CAPTURE_MAX_CHANNELS || chunkSamples < 2) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (aiNumber(ais[i]) == 0) {
+			return NULL;
+		}
+	}
+
+	struct IonoPiCapture *cap = calloc(1, sizeof(struct IonoPiCapture));
+	if (cap == NULL) {
+		return NULL;
+	}
+	cap->count = count;
+	memcpy(cap->ais, ais, count * sizeof(int));
+	cap->periodMicros = periodMicros;
+	cap->chunkSamples = chunkSamples;
+	cap->flushChunks = flushChunks > 0 ? flushChunks : 1;
+	cap->writing = TRUE;
+	cap->offset = CAPTURE_HEADER_SIZE;
+	cap->values = malloc(count * chunkSamples * sizeof(uint16_t));
+	cap->times = malloc(chunkSamples * sizeof(uint64_t));
+	// worst case 13 bits (zigzag of a 12-bit delta) per value and 32 bits
+	// per timestamp
+	cap->chunkBuf = malloc(chunkHeaderSize(cap)
+			+ ((uint64_t) chunkSamples
+					* (count * CAPTURE_MAX_VALUE_WIDTH
+							+ CAPTURE_MAX_TIME_WIDTH)) / 8 + 1);
+	if (cap->values == NULL || cap->times == NULL || cap->chunkBuf == NULL) {
+		captureFree(cap);
+		return NULL;
+	}
+
+	cap->fp = fopen(path, "wb");
+	if (cap->fp == NULL) {
+		captureFree(cap);
+		return NULL;
+	}
+	setvbuf(cap->fp, NULL, _IOFBF, 64 * 1024);
+
+	if (!writeHeader(cap, 0)) {
+		fclose(cap->fp);
+		captureFree(cap);
+		return NULL;
+	}
+
+	return cap;
+}
+
+/*
+ *
+ */
+int ionoPiCaptureWrite(struct IonoPiCapture* cap, uint64_t tsMicros,
+		const int* values) {
+	int c;
+	if (cap == NULL || !cap->writing) {
+		return FALSE;
+	}
+	if (cap->samples > 0 && !timeDeviationFits(cap,
+			cap->times[cap->samples - 1], tsMicros)) {
+		// gap too long to encode, start a new chunk
+		if (!writeChunk(cap)) {
+			return FALSE;
+		}
+	}
+	cap->times[cap->samples] = tsMicros;
+	for (c = 0; c < cap->count; c++) {
+		cap->values[c * cap->chunkSamples + cap->samples] = values[c] & 0x0FFF;
+	}
+	if (++cap->samples == cap->chunkSamples) {
+		return writeChunk(cap);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiCaptureSample(struct IonoPiCapture* cap) {
+	int values[CAPTURE_MAX_CHANNELS];
+	struct timespec now;
+	if (cap == NULL) {
+		return FALSE;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (!ionoPiAnalogReadMany(cap->ais, cap->count, values)) {
+		return FALSE;
+	}
+	return ionoPiCaptureWrite(cap,
+			now.tv_sec * 1000000ULL + now.tv_nsec / 1000, values);
+}
+
+/*
+ *
+ */
+int ionoPiCaptureClose(struct IonoPiCapture* cap) {
+	unsigned char entry[CAPTURE_INDEX_ENTRY_SIZE];
+	unsigned int i;
+	int ok = TRUE;
+
+	if (cap == NULL) {
+		return FALSE;
+	}
+
+	if (cap->writing) {
+		ok = writeChunk(cap);
+		for (i = 0; ok && i < cap->chunks; i++) {
+			memset(entry, 0, sizeof(entry));
+			putLE(entry, cap->index[i].t0, 8);
+			putLE(entry + 8, cap->index[i].t1, 8);
+			putLE(entry + 16, cap->index[i].offset, 8);
+			putLE(entry + 24, cap->index[i].samples, 4);
+			ok = fwrite(entry, sizeof(entry), 1, cap->fp) == 1;
+		}
+		ok = ok && fseek(cap->fp, 0, SEEK_SET) == 0
+				&& writeHeader(cap, cap->offset) && syncFile(cap);
+		if (fclose(cap->fp) != 0) {
+			ok = FALSE;
+		}
+	}
+
+	captureFree(cap);
+	return ok;
+}
+
+/*
+ * Rebuilds the index of a capture not properly closed, dropping a possible
+ * truncated last chunk.
+ */
+static int rebuildIndex(struct IonoPiCapture *cap) {
+	size_t off = CAPTURE_HEADER_SIZE;
+	size_t headerSize = chunkHeaderSize(cap);
+	while (off + headerSize <= cap->mapSize) {
+		const unsigned char *p = cap->map + off;
+		if (memcmp(p, CAPTURE_CHUNK_MAGIC, 4) != 0) {
+			break;
+		}
+		size_t size = headerSize + getLE(p + 24, 4);
+		if (off + size > cap->mapSize) {
+			break;
+		}
+		if (!indexAppend(cap, getLE(p + 4, 8), getLE(p + 12, 8), off,
+				getLE(p + 20, 4))) {
+			return FALSE;
+		}
+		off += size;
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+struct IonoPiCapture* ionoPiCaptureOpen(const char* path) {
+	struct stat st;
+	unsigned int i;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < CAPTURE_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct IonoPiCapture *cap = calloc(1, sizeof(struct IonoPiCapture));
+	if (cap == NULL) {
+		munmap((void *) map, st.st_size);
+		return NULL;
+	}
+	cap->map = map;
+	cap->mapSize = st.st_size;
+
+	if (memcmp(map, CAPTURE_MAGIC, 8) != 0 || map[8] < 1
+			|| map[8] > CAPTURE_MAX_CHANNELS) {
+		captureFree(cap);
+		return NULL;
+	}
+	cap->count = map[8];
+	for (i = 0; (int) i < cap->count; i++) {
+		if (map[9 + i] < 1 || map[9 + i] > 4) {
+			captureFree(cap);
+			return NULL;
+		}
+		cap->ais[i] = aiFromNumber(map[9 + i]);
+	}
+	cap->periodMicros = getLE(map + 16, 4);
+	cap->chunkSamples = getLE(map + 20, 4);
+
+	uint64_t indexOffset = getLE(map + 24, 8);
+	unsigned int chunks = getLE(map + 32, 4);
+	if (indexOffset != 0
+			&& indexOffset + (uint64_t) chunks * CAPTURE_INDEX_ENTRY_SIZE
+					<= cap->mapSize) {
+		for (i = 0; i < chunks; i++) {
+			const unsigned char *p = map + indexOffset
+					+ i * CAPTURE_INDEX_ENTRY_SIZE;
+			if (!indexAppend(cap, getLE(p, 8), getLE(p + 8, 8),
+					getLE(p + 16, 8), getLE(p + 24, 4))) {
+				captureFree(cap);
+				return NULL;
+			}
+		}
+	} else if (!rebuildIndex(cap)) {
+		captureFree(cap);
+		return NULL;
+	}
+
+	return cap;
+}
+
+/*
+ *
+ */
+int ionoPiCaptureInfo(struct IonoPiCapture* cap, int* ais, int* count,
+		unsigned int* periodMicros, uint64_t* startMicros, uint64_t* endMicros) {
+	if (cap == NULL) {
+		return FALSE;
+	}
+	if (ais != NULL) {
+		memcpy(ais, cap->ais, cap->count * sizeof(int));
+	}
+	if (count != NULL) {
+		*count = cap->count;
+	}
+	if (periodMicros != NULL) {
+		*periodMicros = cap->periodMicros;
+	}
+	if (startMicros != NULL) {
+		*startMicros = cap->chunks > 0 ? cap->index[0].t0 : 0;
+	}
+	if (endMicros != NULL) {
+		*endMicros = cap->chunks > 0 ? cap->index[cap->chunks - 1].t1 : 0;
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiCaptureRead(struct IonoPiCapture* cap, uint64_t fromMicros,
+		uint64_t toMicros,
+		int (*callBack)(uint64_t tsMicros, int count, const int* values)) {
+	int values[CAPTURE_MAX_CHANNELS];
+	int widths[CAPTURE_MAX_CHANNELS];
+	size_t bitOffsets[CAPTURE_MAX_CHANNELS];
+	size_t timeBitOffset;
+	int timeWidth;
+	unsigned int lo, hi, k, i;
+	int c;
+
+	if (cap == NULL || cap->map == NULL || callBack == NULL) {
+		return FALSE;
+	}
+
+	// first chunk ending at or after fromMicros
+	lo = 0;
+	hi = cap->chunks;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (cap->index[mid].t1 < fromMicros) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (k = lo; k < cap->chunks && cap->index[k].t0 <= toMicros; k++) {
+		const struct CaptureIndexEntry *e = &cap->index[k];
+		size_t headerSize = chunkHeaderSize(cap);
+		if (e->offset + headerSize > cap->mapSize) {
+			return FALSE;
+		}
+		const unsigned char *p = cap->map + e->offset;
+		const unsigned char *payload = p + headerSize;
+		size_t payloadSize = getLE(p + 24, 4);
+		if (memcmp(p, CAPTURE_CHUNK_MAGIC, 4) != 0
+				|| e->offset + headerSize + payloadSize > cap->mapSize) {
+			return FALSE;
+		}
+
+		if (e->samples == 0) {
+			return FALSE;
+		}
+		uint64_t bits = 0;
+		for (c = 0; c < cap->count; c++) {
+			values[c] = getLE(p + CAPTURE_CHUNK_HEADER_SIZE + c * 3, 2);
+			widths[c] = p[CAPTURE_CHUNK_HEADER_SIZE + c * 3 + 2];
+			if (widths[c] > CAPTURE_MAX_VALUE_WIDTH) {
+				return FALSE;
+			}
+			bitOffsets[c] = bits;
+			bits += (uint64_t) widths[c] * (e->samples - 1);
+		}
+		timeWidth = p[headerSize - 1];
+		if (timeWidth > CAPTURE_MAX_TIME_WIDTH) {
+			return FALSE;
+		}
+		timeBitOffset = bits;
+		bits += (uint64_t) timeWidth * (e->samples - 1);
+		if ((bits + 7) / 8 > payloadSize) {
+			return FALSE;
+		}
+
+		uint64_t ts = e->t0;
+		for (i = 0; i < e->samples; i++) {
+			if (i > 0) {
+				for (c = 0; c < cap->count; c++) {
+					uint32_t zz = getBits(payload, &bitOffsets[c], widths[c]);
+					values[c] += (int) (zz >> 1) ^ -(int) (zz & 1);
+				}
+				uint32_t zz = getBits(payload, &timeBitOffset, timeWidth);
+				ts += cap->periodMicros
+						+ (int64_t) ((int32_t) (zz >> 1) ^ -(int32_t) (zz & 1));
+			}
+			if (ts < fromMicros) {
+				continue;
+			}
+			if (ts > toMicros) {
+				return TRUE;
+			}
+			if (!callBack(ts, cap->count, values)) {
+				return TRUE;
+			}
+		}
+	}
+
+	return TRUE;
+}
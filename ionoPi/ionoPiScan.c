@@ -0,0 +1,273 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * PLC-style scan cycle: at every period the inputs are read into an image,
+ * the user logic computes the outputs image from it, and the outputs are
+ * written together.
+ *
+ * The relays and open collectors are wiringPi pins 0..6, so they are
+ * written with a single digitalWriteByte(), i.e. one write to the GPIO
+ * clear and set registers. The outputs not changed by the logic, as well as
+ * pin 7 (TTL1), are read back right before the write and kept at their
+ * current level, so that changes made meanwhile by other threads, reflex
+ * rules or access control are not undone.
+ */
+
+#include "ionoPi.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <wiringPi.h>
+
+/* from ionoPi.c */
+extern void checkRealtime(int thread);
+extern void recordTiming(int thread, unsigned long int usec);
+
+struct ScanStats {
+	atomic_ulong cycles;
+	atomic_ulong overruns;
+	atomic_ullong sumCycle;
+	atomic_ulong minCycle;
+	atomic_ulong maxCycle;
+	atomic_ullong sumJitter;
+	atomic_ulong maxJitter;
+} scanStats = { 0, 0, 0, ULONG_MAX, 0, 0, 0 };
+
+atomic_int scanRun = FALSE;
+
+/*
+ *
+ */
+static uint64_t toMicros(struct timespec* t) {
+	return t->tv_sec * 1000000ULL + t->tv_nsec / 1000;
+}
+
+/*
+ *
+ */
+static void addMicros(struct timespec* t, unsigned long int usec) {
+	t->tv_sec += usec / 1000000;
+	t->tv_nsec += (usec % 1000000) * 1000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec += 1;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ *
+ */
+static void readInputs(struct IonoPiScanInputs* in, int flags) {
+	static const int ais[] = { AI1, AI2, AI3, AI4 };
+	int i;
+
+	// digital inputs first, back to back
+	for (i = 0; i < 6; i++) {
+		in->di[i] = ionoPiDigitalReadIndex(i);
+	}
+	for (i = 0; i < 4; i++) {
+		in->ttl[i] = ionoPiDigitalReadIndex(6 + i);
+	}
+	if (flags & IONOPI_SCAN_ANALOG) {
+		for (i = 0; i < 4; i++) {
+			in->ai[i] = ionoPiAnalogRead(ais[i]);
+		}
+	}
+}
+
+/*
+ *
+ */
+static void readOutputs(struct IonoPiScanOutputs* out) {
+	out->o[0] = digitalRead(O1);
+	out->o[1] = digitalRead(O2);
+	out->o[2] = digitalRead(O3);
+	out->o[3] = digitalRead(O4);
+	out->oc[0] = digitalRead(OC1);
+	out->oc[1] = digitalRead(OC2);
+	out->oc[2] = digitalRead(OC3);
+	out->led = digitalRead(LED);
+}
+
+/*
+ * Returns the level to write on the given pin: the one set by the logic if
+ * changed, the current one otherwise.
+ */
+static int outputBit(int pin, int value, int prevValue) {
+	if (value == prevValue) {
+		value = digitalRead(pin);
+	}
+	return value ? 1 << pin : 0;
+}
+
+/*
+ * Writes the outputs changed from the levels read at the start of the
+ * cycle.
+ */
+static void writeOutputs(struct IonoPiScanOutputs* out,
+		struct IonoPiScanOutputs* prev) {
+	if (memcmp(out->o, prev->o, sizeof(out->o)) != 0
+			|| memcmp(out->oc, prev->oc, sizeof(out->oc)) != 0) {
+		int value = outputBit(O1, out->o[0], prev->o[0])
+				| outputBit(O2, out->o[1], prev->o[1])
+				| outputBit(O3, out->o[2], prev->o[2])
+				| outputBit(O4, out->o[3], prev->o[3])
+				| outputBit(OC1, out->oc[0], prev->oc[0])
+				| outputBit(OC2, out->oc[1], prev->oc[1])
+				| outputBit(OC3, out->oc[2], prev->oc[2])
+				| (digitalRead(TTL1) ? 1 << TTL1 : 0);
+		digitalWriteByte(value);
+	}
+	if (out->led != prev->led) {
+		digitalWrite(LED, out->led ? HIGH : LOW);
+	}
+}
+
+/*
+ *
+ */
+static void updateStats(unsigned long int cycle_usec,
+		unsigned long int jitter_usec) {
+	unsigned long int curr;
+
+	atomic_fetch_add(&scanStats.cycles, 1);
+	atomic_fetch_add(&scanStats.sumCycle, cycle_usec);
+	atomic_fetch_add(&scanStats.sumJitter, jitter_usec);
+	curr = atomic_load(&scanStats.minCycle);
+	while (cycle_usec < curr
+			&& !atomic_compare_exchange_weak(&scanStats.minCycle, &curr,
+					cycle_usec)) {
+	}
+	curr = atomic_load(&scanStats.maxCycle);
+	while (cycle_usec > curr
+			&& !atomic_compare_exchange_weak(&scanStats.maxCycle, &curr,
+					cycle_usec)) {
+	}
+	curr = atomic_load(&scanStats.maxJitter);
+	while (jitter_usec > curr
+			&& !atomic_compare_exchange_weak(&scanStats.maxJitter, &curr,
+					jitter_usec)) {
+	}
+}
+
+/*
+ *
+ */
+int ionoPiScanCycle(unsigned int periodMicros, int flags,
+		int (*logic)(const struct IonoPiScanInputs*,
+				struct IonoPiScanOutputs*, void*), void* arg) {
+	struct IonoPiScanInputs in;
+	struct IonoPiScanOutputs out, prev;
+	struct timespec next, start, end;
+	uint64_t late;
+	int ok = TRUE;
+
+	if (periodMicros == 0 || logic == NULL) {
+		return FALSE;
+	}
+	if (atomic_exchange(&scanRun, TRUE)) {
+		// already running
+		return FALSE;
+	}
+
+	memset(&in, 0, sizeof(in));
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (ok && atomic_load(&scanRun)) {
+		checkRealtime(IONOPI_THREAD_SCAN);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		late = toMicros(&start) - toMicros(&next);
+		recordTiming(IONOPI_THREAD_SCAN, late);
+
+		readInputs(&in, flags);
+		in.cycle++;
+		in.tsMicros = toMicros(&start);
+
+		// outputs may have been changed by other threads since last cycle
+		readOutputs(&prev);
+		out = prev;
+		ok = logic(&in, &out, arg);
+		writeOutputs(&out, &prev);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		updateStats(toMicros(&end) - toMicros(&start), late);
+
+		addMicros(&next, periodMicros);
+		if (toMicros(&end) >= toMicros(&next)) {
+			// overrun, skip the missed cycles keeping the phase
+			uint64_t missed = (toMicros(&end) - toMicros(&next))
+					/ periodMicros + 1;
+			addMicros(&next, missed * periodMicros);
+			atomic_fetch_add(&scanStats.overruns, 1);
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+				== EINTR) {
+		}
+	}
+
+	atomic_store(&scanRun, FALSE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiScanCycleStop() {
+	atomic_store(&scanRun, FALSE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiGetScanStats(struct IonoPiScanStats* stats, int reset) {
+	if (stats == NULL) {
+		return FALSE;
+	}
+	unsigned long int cycles = atomic_load(&scanStats.cycles);
+	stats->cycles = cycles;
+	stats->overruns = atomic_load(&scanStats.overruns);
+	stats->minCycleMicros = cycles > 0 ? atomic_load(&scanStats.minCycle) : 0;
+	stats->maxCycleMicros = atomic_load(&scanStats.maxCycle);
+	stats->meanCycleMicros =
+			cycles > 0 ? atomic_load(&scanStats.sumCycle) / cycles : 0;
+	stats->maxJitterMicros = atomic_load(&scanStats.maxJitter);
+	stats->meanJitterMicros =
+			cycles > 0 ? atomic_load(&scanStats.sumJitter) / cycles : 0;
+	if (reset) {
+		atomic_store(&scanStats.cycles, 0);
+		atomic_store(&scanStats.overruns, 0);
+		atomic_store(&scanStats.sumCycle, 0);
+		atomic_store(&scanStats.minCycle, ULONG_MAX);
+		atomic_store(&scanStats.maxCycle, 0);
+		atomic_store(&scanStats.sumJitter, 0);
+		atomic_store(&scanStats.maxJitter, 0);
+	}
+	return TRUE;
+}
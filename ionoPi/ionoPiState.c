@@ -0,0 +1,307 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+/*
+ * Publishing of the I/O state in a POSIX shared memory segment.
+ *
+ * A single publisher process samples the inputs and writes a struct
+ * IonoPiState in the segment under a seqlock, so that any number of reader
+ * processes can take consistent snapshots without system calls or locks.
+ * The state is stored as an array of 32-bit atomic words, written and read
+ * one by one between the sequence number updates.
+ */
+
+#include "ionoPi.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define STATE_MAGIC				0x494F4E4F
+#define STATE_VERSION			1
+#define STATE_WORDS				(sizeof(struct IonoPiState) / 4)
+#define STATE_READ_MAX_SPINS	1000000
+
+struct IonoPiStateShm {
+	atomic_uint magic;
+	atomic_uint version;
+	atomic_uint seq;
+	atomic_uint words[STATE_WORDS];
+};
+
+atomic_int statePublishRun = 0;
+
+struct IonoPiState stateOneWire;
+pthread_mutex_t stateOneWireMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int stateOneWirePeriodMillis;
+
+/*
+ *
+ */
+static uint64_t monotonicMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ *
+ */
+static void writeState(struct IonoPiStateShm* shm, struct IonoPiState* state) {
+	uint32_t words[STATE_WORDS];
+	unsigned int i;
+	unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	state->seq = (seq + 2) / 2;
+	memcpy(words, state, sizeof(words));
+	for (i = 0; i < STATE_WORDS; i++) {
+		atomic_store_explicit(&shm->words[i], words[i], memory_order_relaxed);
+	}
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Reads the 1-Wire bus devices into stateOneWire, one at a time since each
+ * conversion can take up to ~750 ms.
+ */
+static void *oneWireThread(void *arg) {
+	char** ids = NULL;
+	int n, count, i, temp;
+
+	while (atomic_load(&statePublishRun)) {
+		n = ionoPi1WireBusGetDevices(&ids);
+		count = n < IONOPI_STATE_MAX_1WIRE ? n : IONOPI_STATE_MAX_1WIRE;
+		for (i = 0; i < count && atomic_load(&statePublishRun); i++) {
+			if (ionoPi1WireBusReadTemperature(ids[i], 3, &temp)) {
+				pthread_mutex_lock(&stateOneWireMutex);
+				snprintf(stateOneWire.oneWireIds[i],
+						sizeof(stateOneWire.oneWireIds[i]), "%s", ids[i]);
+				stateOneWire.oneWireTemp[i] = temp;
+				stateOneWire.oneWireTs[i] = monotonicMicros();
+				pthread_mutex_unlock(&stateOneWireMutex);
+			}
+		}
+		pthread_mutex_lock(&stateOneWireMutex);
+		stateOneWire.oneWireCount = count > 0 ? count : 0;
+		pthread_mutex_unlock(&stateOneWireMutex);
+		if (n > 0) {
+			for (i = 0; i < n; i++) {
+				free(ids[i]);
+			}
+			free(ids);
+		}
+		usleep(stateOneWirePeriodMillis * 1000);
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+int ionoPiStatePublish(const char* name, unsigned int periodMillis,
+		unsigned int oneWirePeriodMillis) {
+	static const int dis[] = { DI1, DI2, DI3, DI4, DI5, DI6 };
+	static const int ttls[] = { TTL1, TTL2, TTL3, TTL4 };
+	static const int os[] = { O1, O2, O3, O4 };
+	static const int ocs[] = { OC1, OC2, OC3 };
+	static const int ais[] = { AI1, AI2, AI3, AI4 };
+	struct IonoPiState state;
+	pthread_t thread;
+	int ai[4];
+	int i;
+
+	if (periodMillis == 0) {
+		return FALSE;
+	}
+	if (name == NULL) {
+		name = IONOPI_STATE_NAME;
+	}
+
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (ftruncate(fd, sizeof(struct IonoPiStateShm)) != 0) {
+		close(fd);
+		return FALSE;
+	}
+	struct IonoPiStateShm *shm = mmap(NULL, sizeof(struct IonoPiStateShm),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		return FALSE;
+	}
+
+	unsigned int seq = atomic_load(&shm->seq);
+	if (seq & 1) {
+		// previous publisher terminated while writing
+		atomic_store(&shm->seq, seq + 1);
+	}
+	atomic_store(&shm->magic, STATE_MAGIC);
+	atomic_store(&shm->version, STATE_VERSION);
+	memset(&state, 0, sizeof(state));
+	memset(&stateOneWire, 0, sizeof(stateOneWire));
+
+	atomic_store(&statePublishRun, TRUE);
+
+	if (oneWirePeriodMillis > 0) {
+		stateOneWirePeriodMillis = oneWirePeriodMillis;
+		if (pthread_create(&thread, NULL, oneWireThread, NULL) != 0) {
+			munmap(shm, sizeof(struct IonoPiStateShm));
+			return FALSE;
+		}
+		pthread_detach(thread);
+	}
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (atomic_load(&statePublishRun)) {
+		for (i = 0; i < 6; i++) {
+			state.di[i] = ionoPiDigitalRead(dis[i]);
+		}
+		for (i = 0; i < 4; i++) {
+			state.ttl[i] = ionoPiDigitalRead(ttls[i]);
+			state.o[i] = ionoPiDigitalRead(os[i]);
+		}
+		for (i = 0; i < 3; i++) {
+			state.oc[i] = ionoPiDigitalRead(ocs[i]);
+		}
+		state.led = ionoPiDigitalRead(LED);
+		if (ionoPiAnalogReadMany(ais, 4, ai)) {
+			for (i = 0; i < 4; i++) {
+				state.ai[i] = ai[i];
+			}
+			state.aiTs = monotonicMicros();
+		}
+
+		pthread_mutex_lock(&stateOneWireMutex);
+		state.oneWireCount = stateOneWire.oneWireCount;
+		memcpy(state.oneWireIds, stateOneWire.oneWireIds,
+				sizeof(state.oneWireIds));
+		memcpy(state.oneWireTemp, stateOneWire.oneWireTemp,
+				sizeof(state.oneWireTemp));
+		memcpy(state.oneWireTs, stateOneWire.oneWireTs,
+				sizeof(state.oneWireTs));
+		pthread_mutex_unlock(&stateOneWireMutex);
+
+		state.ts = monotonicMicros();
+		writeState(shm, &state);
+
+		next.tv_sec += periodMillis / 1000;
+		next.tv_nsec += (periodMillis % 1000) * 1000000L;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec += 1;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	munmap(shm, sizeof(struct IonoPiStateShm));
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiStatePublishStop() {
+	atomic_store(&statePublishRun, FALSE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+struct IonoPiStateShm* ionoPiStateOpen(const char* name) {
+	if (name == NULL) {
+		name = IONOPI_STATE_NAME;
+	}
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct IonoPiStateShm *shm = mmap(NULL, sizeof(struct IonoPiStateShm),
+			PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		return NULL;
+	}
+	if (atomic_load(&shm->magic) != STATE_MAGIC
+			|| atomic_load(&shm->version) != STATE_VERSION) {
+		munmap(shm, sizeof(struct IonoPiStateShm));
+		return NULL;
+	}
+	return shm;
+}
+
+/*
+ *
+ */
+int ionoPiStateRead(struct IonoPiStateShm* shm, struct IonoPiState* state) {
+	uint32_t words[STATE_WORDS];
+	unsigned int seq, i, spins = 0;
+
+	if (shm == NULL || state == NULL) {
+		return FALSE;
+	}
+
+	do {
+		while ((seq = atomic_load_explicit(&shm->seq, memory_order_acquire))
+				& 1) {
+			if (++spins > STATE_READ_MAX_SPINS) {
+				// publisher terminated while writing
+				return FALSE;
+			}
+		}
+		for (i = 0; i < STATE_WORDS; i++) {
+			words[i] = atomic_load_explicit(&shm->words[i],
+					memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&shm->seq, memory_order_relaxed) != seq);
+
+	if (seq == 0) {
+		// nothing published yet
+		return FALSE;
+	}
+
+	memcpy(state, words, sizeof(words));
+	return TRUE;
+}
+
+/*
+ *
+ */
+void ionoPiStateClose(struct IonoPiStateShm* shm) {
+	if (shm != NULL) {
+		munmap(shm, sizeof(struct IonoPiStateShm));
+	}
+}
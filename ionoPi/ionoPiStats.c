@@ -0,0 +1,440 @@
+/*
+ * ionoPi
+ *
+ *     Copyright (C) 2016-2019 Sfera Labs S.r.l.
+ *
+ *     For information, see the Iono Pi web site:
+ *     http://www.sferalabs.cc/iono-pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Lesser Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/lgpl-3.0.html>.
+ *
+ */
+
+
+/*
+ * Windowed statistics of the analog inputs and 1-Wire temperatures.
+ *
+ * Each window is divided in STATS_BUCKETS buckets holding count, sum, sum
+ * of squares, min and max of the values in their time slot. The window
+ * keeps the running sums of its closed buckets, updated when a bucket is
+ * closed or expires, and monotonic deques of the buckets with the
+ * candidate min and max, so that queries are O(1) and the memory per
+ * channel is fixed. The window slides by one bucket at a time. Sums are
+ * integers (raw values, millis of °C), so they do not drift.
+ */
+
+#include "ionoPi.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define STATS_BUCKETS			60
+#define STATS_CHANNELS			(4 + IONOPI_STATS_MAX_1WIRE)
+
+struct StatsBucket {
+	int64_t sum;
+	int64_t sumSq;
+	uint32_t count;
+	int min;
+	int max;
+};
+
+struct StatsDeque {
+	uint64_t idx[STATS_BUCKETS];
+	int head;
+	int len;
+};
+
+struct StatsWindow {
+	uint64_t bucketMillis;
+	struct StatsBucket buckets[STATS_BUCKETS];
+	uint64_t cur;
+	int64_t sum;
+	int64_t sumSq;
+	uint64_t count;
+	struct StatsDeque minDq;
+	struct StatsDeque maxDq;
+};
+
+struct StatsChannel {
+	char id[20];
+	int windowsCount;
+	struct StatsWindow* windows;
+	pthread_mutex_t mutex;
+};
+
+struct StatsChannel statsChannels[STATS_CHANNELS] = {
+	[0 ... STATS_CHANNELS - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER }
+};
+
+unsigned int statsWindowsMillis[IONOPI_STATS_WINDOWS_MAX] = { 1000, 60000,
+		3600000 };
+int statsWindowsCount = 3;
+pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* analog inputs sampled for the statistics, used by the sampler */
+atomic_int statsAnalogEnabled[4];
+
+/*
+ *
+ */
+static uint64_t monotonicMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/*
+ *
+ */
+static int analogIndex(int ai) {
+	switch (ai) {
+	case AI1:
+		return 0;
+	case AI2:
+		return 1;
+	case AI3:
+		return 2;
+	case AI4:
+		return 3;
+	default:
+		return -1;
+	}
+}
+
+/*
+ *
+ */
+static void dequeClear(struct StatsDeque* dq) {
+	dq->head = 0;
+	dq->len = 0;
+}
+
+/*
+ *
+ */
+static uint64_t dequeFront(struct StatsDeque* dq) {
+	return dq->idx[dq->head];
+}
+
+/*
+ *
+ */
+static uint64_t dequeBack(struct StatsDeque* dq) {
+	return dq->idx[(dq->head + dq->len - 1) % STATS_BUCKETS];
+}
+
+/*
+ * Appends a bucket, first removing the ones at the back that can no longer
+ * be the min (or max) since older than it and not lower (or greater).
+ */
+static void dequePush(struct StatsWindow* w, struct StatsDeque* dq,
+		uint64_t idx, int isMax) {
+	struct StatsBucket* b = &w->buckets[idx % STATS_BUCKETS];
+	while (dq->len > 0) {
+		struct StatsBucket* back = &w->buckets[dequeBack(dq) % STATS_BUCKETS];
+		if (isMax ? back->max > b->max : back->min < b->min) {
+			break;
+		}
+		dq->len--;
+	}
+	dq->idx[(dq->head + dq->len) % STATS_BUCKETS] = idx;
+	dq->len++;
+}
+
+/*
+ *
+ */
+static void dequeExpire(struct StatsDeque* dq, uint64_t oldest) {
+	while (dq->len > 0 && dequeFront(dq) < oldest) {
+		dq->head = (dq->head + 1) % STATS_BUCKETS;
+		dq->len--;
+	}
+}
+
+/*
+ *
+ */
+static void windowReset(struct StatsWindow* w, uint64_t idx) {
+	memset(w->buckets, 0, sizeof(w->buckets));
+	w->cur = idx;
+	w->sum = 0;
+	w->sumSq = 0;
+	w->count = 0;
+	dequeClear(&w->minDq);
+	dequeClear(&w->maxDq);
+}
+
+/*
+ * Slides the window to the bucket of the given time: the current bucket is
+ * closed and the ones older than the window expire.
+ */
+static void windowAdvance(struct StatsWindow* w, uint64_t nowMillis) {
+	uint64_t idx = nowMillis / w->bucketMillis;
+	if (idx <= w->cur) {
+		return;
+	}
+	if (idx - w->cur >= STATS_BUCKETS) {
+		windowReset(w, idx);
+		return;
+	}
+	while (w->cur < idx) {
+		struct StatsBucket* b = &w->buckets[w->cur % STATS_BUCKETS];
+		if (b->count > 0) {
+			w->sum += b->sum;
+			w->sumSq += b->sumSq;
+			w->count += b->count;
+			dequePush(w, &w->minDq, w->cur, FALSE);
+			dequePush(w, &w->maxDq, w->cur, TRUE);
+		}
+		w->cur++;
+		// the new bucket reuses the slot of the one leaving the window
+		b = &w->buckets[w->cur % STATS_BUCKETS];
+		w->sum -= b->sum;
+		w->sumSq -= b->sumSq;
+		w->count -= b->count;
+		memset(b, 0, sizeof(*b));
+		dequeExpire(&w->minDq, w->cur - STATS_BUCKETS + 1);
+		dequeExpire(&w->maxDq, w->cur - STATS_BUCKETS + 1);
+	}
+}
+
+/*
+ *
+ */
+static void windowAdd(struct StatsWindow* w, uint64_t nowMillis, int value) {
+	windowAdvance(w, nowMillis);
+	struct StatsBucket* b = &w->buckets[w->cur % STATS_BUCKETS];
+	if (b->count == 0 || value < b->min) {
+		b->min = value;
+	}
+	if (b->count == 0 || value > b->max) {
+		b->max = value;
+	}
+	b->count++;
+	b->sum += value;
+	b->sumSq += (int64_t) value * value;
+}
+
+/*
+ * Computes the statistics in the unit of the values multiplied by factor.
+ */
+static int windowRead(struct StatsWindow* w, uint64_t nowMillis, float factor,
+		struct IonoPiWindowStats* stats) {
+	windowAdvance(w, nowMillis);
+	struct StatsBucket* b = &w->buckets[w->cur % STATS_BUCKETS];
+	uint64_t count = w->count + b->count;
+	int min, max;
+
+	stats->count = count;
+	if (count == 0) {
+		stats->min = stats->max = stats->mean = stats->stdDev = 0;
+		return FALSE;
+	}
+	if (w->minDq.len > 0) {
+		min = w->buckets[dequeFront(&w->minDq) % STATS_BUCKETS].min;
+		max = w->buckets[dequeFront(&w->maxDq) % STATS_BUCKETS].max;
+		if (b->count > 0) {
+			min = b->min < min ? b->min : min;
+			max = b->max > max ? b->max : max;
+		}
+	} else {
+		min = b->min;
+		max = b->max;
+	}
+	double sum = w->sum + b->sum;
+	double sumSq = w->sumSq + b->sumSq;
+	double mean = sum / count;
+	double var = sumSq / count - mean * mean;
+	stats->min = min * factor;
+	stats->max = max * factor;
+	stats->mean = mean * factor;
+	stats->stdDev = (var > 0 ? sqrt(var) : 0) * fabsf(factor);
+	return TRUE;
+}
+
+/*
+ * Allocates the windows of a channel if needed. Called with its mutex held.
+ */
+static int channelInit(struct StatsChannel* ch, uint64_t nowMillis) {
+	int i;
+	if (ch->windows != NULL) {
+		return TRUE;
+	}
+	pthread_mutex_lock(&statsMutex);
+	int count = statsWindowsCount;
+	ch->windows = calloc(count, sizeof(struct StatsWindow));
+	if (ch->windows != NULL) {
+		ch->windowsCount = count;
+		for (i = 0; i < count; i++) {
+			ch->windows[i].bucketMillis = statsWindowsMillis[i] / STATS_BUCKETS;
+			windowReset(&ch->windows[i],
+					nowMillis / ch->windows[i].bucketMillis);
+		}
+	}
+	pthread_mutex_unlock(&statsMutex);
+	return ch->windows != NULL;
+}
+
+/*
+ *
+ */
+static void channelAdd(struct StatsChannel* ch, int value) {
+	uint64_t now = monotonicMillis();
+	int i;
+	pthread_mutex_lock(&ch->mutex);
+	if (channelInit(ch, now)) {
+		for (i = 0; i < ch->windowsCount; i++) {
+			windowAdd(&ch->windows[i], now, value);
+		}
+	}
+	pthread_mutex_unlock(&ch->mutex);
+}
+
+/*
+ *
+ */
+static int channelRead(struct StatsChannel* ch, int window, float factor,
+		struct IonoPiWindowStats* stats) {
+	int ok = FALSE;
+	pthread_mutex_lock(&ch->mutex);
+	if (ch->windows != NULL && window >= 0 && window < ch->windowsCount) {
+		ok = windowRead(&ch->windows[window], monotonicMillis(), factor,
+				stats);
+	}
+	pthread_mutex_unlock(&ch->mutex);
+	return ok;
+}
+
+/*
+ * Called by the sampler thread.
+ */
+void statsAnalogAdd(int index, int raw) {
+	channelAdd(&statsChannels[index], raw);
+}
+
+/*
+ * Called on every temperature read from the 1-Wire bus.
+ */
+void stats1WireAdd(const char* deviceId, int temp) {
+	struct StatsChannel* ch = NULL;
+	int i;
+	pthread_mutex_lock(&statsMutex);
+	for (i = 4; i < STATS_CHANNELS; i++) {
+		if (strcmp(statsChannels[i].id, deviceId) == 0) {
+			ch = &statsChannels[i];
+			break;
+		}
+		if (statsChannels[i].id[0] == '\0') {
+			ch = &statsChannels[i];
+			snprintf(ch->id, sizeof(ch->id), "%s", deviceId);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&statsMutex);
+	if (ch != NULL) {
+		channelAdd(ch, temp);
+	}
+}
+
+/*
+ *
+ */
+int ionoPiStatsSetup(const unsigned int* windowsMillis, int count) {
+	int i;
+	if (windowsMillis != NULL) {
+		if (count < 1 || count > IONOPI_STATS_WINDOWS_MAX) {
+			return FALSE;
+		}
+		for (i = 0; i < count; i++) {
+			if (windowsMillis[i] < STATS_BUCKETS) {
+				return FALSE;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&statsMutex);
+	if (windowsMillis != NULL) {
+		memcpy(statsWindowsMillis, windowsMillis, count * sizeof(int));
+		statsWindowsCount = count;
+	}
+	pthread_mutex_unlock(&statsMutex);
+
+	// channels are reallocated with the new windows on the next value
+	for (i = 0; i < STATS_CHANNELS; i++) {
+		struct StatsChannel* ch = &statsChannels[i];
+		pthread_mutex_lock(&ch->mutex);
+		free(ch->windows);
+		ch->windows = NULL;
+		ch->windowsCount = 0;
+		if (i >= 4) {
+			ch->id[0] = '\0';
+		}
+		pthread_mutex_unlock(&ch->mutex);
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiStatsAnalog(int ai, int enable) {
+	int i = analogIndex(ai);
+	if (i < 0) {
+		return FALSE;
+	}
+	atomic_store(&statsAnalogEnabled[i], enable ? TRUE : FALSE);
+	return TRUE;
+}
+
+/*
+ *
+ */
+int ionoPiStatsReadAnalog(int ai, int window, struct IonoPiWindowStats* stats) {
+	int i = analogIndex(ai);
+	if (i < 0 || stats == NULL) {
+		return FALSE;
+	}
+	return channelRead(&statsChannels[i], window, ionoPiRawToVoltage(ai, 1),
+			stats);
+}
+
+/*
+ *
+ */
+int ionoPiStatsRead1Wire(const char* deviceId, int window,
+		struct IonoPiWindowStats* stats) {
+	struct StatsChannel* ch = NULL;
+	int i;
+	if (deviceId == NULL || stats == NULL) {
+		return FALSE;
+	}
+	pthread_mutex_lock(&statsMutex);
+	for (i = 4; i < STATS_CHANNELS; i++) {
+		if (strcmp(statsChannels[i].id, deviceId) == 0) {
+			ch = &statsChannels[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&statsMutex);
+	if (ch == NULL) {
+		return FALSE;
+	}
+	return channelRead(ch, window, 0.001f, stats);
+}
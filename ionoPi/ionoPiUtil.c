@@ -27,6 +27,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#define MONITOR_MAX_CHANNELS	64
+#define MONITOR_AI_PERIOD_MS	1000
+#define MONITOR_1WIRE_PERIOD_MS	10000
+#define MONITOR_FLUSH_MS		100
+
+#define MONITOR_CSV				0
+#define MONITOR_JSON			1
+#define MONITOR_BIN				2
+
+#define MONITOR_TYPE_DI			1
+#define MONITOR_TYPE_TTL		2
+#define MONITOR_TYPE_AI			3
+#define MONITOR_TYPE_1WIRE		4
+#define MONITOR_TYPE_WIEGAND	5
 
 void printDigitalValue(int di, int val) {
 	if (val == HIGH) {
@@ -44,8 +62,610 @@ int printWiegand(int interface, int bitCount, uint64_t data) {
 	return printWiegandCont;
 }
 
+struct MonitorChannel {
+	int type;
+	int index;
+	int pin;
+	char name[32];
+	char *deviceId;
+	unsigned long int period_ms;
+	struct timespec next;
+};
+
+struct MonitorChannel monitorChannels[MONITOR_MAX_CHANNELS];
+int monitorChannelsCount = 0;
+int monitorOneWireCount = 0;
+int monitorFormat = MONITOR_CSV;
+pthread_mutex_t monitorMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *
+ */
+void monitorAddMs(struct timespec *ts, unsigned long int ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ *
+ */
+int monitorBefore(struct timespec *t1, struct timespec *t2) {
+	return t1->tv_sec < t2->tv_sec
+			|| (t1->tv_sec == t2->tv_sec && t1->tv_nsec < t2->tv_nsec);
+}
+
+/*
+ * Writes a sample to the (fully buffered) standard output, which is flushed
+ * periodically by the main monitor loop. Values are passed in millis of V
+ * or °C for analog inputs and 1-Wire temperatures, which are signed and
+ * passed in two's complement. Binary records are 20 bytes, little-endian:
+ * timestamp (us, u64), value (u64 for Wiegand frames, s64 otherwise), type,
+ * index, bits, 0; analog values are raw A/D readings.
+ */
+void monitorEmit(struct MonitorChannel *ch, uint64_t value, int bits) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t ts_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+
+	pthread_mutex_lock(&monitorMutex);
+	if (monitorFormat == MONITOR_BIN) {
+		unsigned char rec[20];
+		int i;
+		for (i = 0; i < 8; i++) {
+			rec[i] = (ts_us >> (8 * i)) & 0xFF;
+			rec[8 + i] = (value >> (8 * i)) & 0xFF;
+		}
+		rec[16] = ch->type;
+		rec[17] = ch->index;
+		rec[18] = bits;
+		rec[19] = 0;
+		fwrite(rec, sizeof(rec), 1, stdout);
+	} else {
+		char val[32];
+		if (ch->type == MONITOR_TYPE_AI || ch->type == MONITOR_TYPE_1WIRE) {
+			snprintf(val, sizeof(val), "%.3f", (int64_t) value / 1000.0);
+		} else {
+			snprintf(val, sizeof(val), "%ju", (uintmax_t) value);
+		}
+		if (monitorFormat == MONITOR_JSON) {
+			if (ch->type == MONITOR_TYPE_WIEGAND) {
+				printf("{\"ts\":%ju,\"ch\":\"%s\",\"val\":%s,\"bits\":%d}\n",
+						(uintmax_t) (ts_us / 1000), ch->name, val, bits);
+			} else {
+				printf("{\"ts\":%ju,\"ch\":\"%s\",\"val\":%s}\n",
+						(uintmax_t) (ts_us / 1000), ch->name, val);
+			}
+		} else {
+			if (ch->type == MONITOR_TYPE_WIEGAND) {
+				printf("%ju,%s,%s,%d\n", (uintmax_t) (ts_us / 1000), ch->name,
+						val, bits);
+			} else {
+				printf("%ju,%s,%s\n", (uintmax_t) (ts_us / 1000), ch->name,
+						val);
+			}
+		}
+	}
+	pthread_mutex_unlock(&monitorMutex);
+}
+
+/*
+ *
+ */
+void monitorDigitalCB(int di, int val) {
+	int i;
+	for (i = 0; i < monitorChannelsCount; i++) {
+		if ((monitorChannels[i].type == MONITOR_TYPE_DI
+				|| monitorChannels[i].type == MONITOR_TYPE_TTL)
+				&& monitorChannels[i].pin == di) {
+			monitorEmit(&monitorChannels[i], val, 0);
+			return;
+		}
+	}
+}
+
+/*
+ *
+ */
+int monitorWiegandCB(int interface, int bitCount, uint64_t data) {
+	int i;
+	for (i = 0; i < monitorChannelsCount; i++) {
+		if (monitorChannels[i].type == MONITOR_TYPE_WIEGAND
+				&& monitorChannels[i].index == interface) {
+			monitorEmit(&monitorChannels[i], data, bitCount);
+			break;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ *
+ */
+void *monitorWiegandThread(void *arg) {
+	struct MonitorChannel *ch = (struct MonitorChannel *) arg;
+	if (!ionoPiWiegandMonitor(ch->index, monitorWiegandCB)) {
+		fprintf(stderr, "Wiegand error\n");
+	}
+	return NULL;
+}
+
+/*
+ * Polls the channels of the given type, each at its own period. 1-Wire
+ * conversions take up to ~750 ms so they are polled in a separate thread
+ * from the analog inputs.
+ */
+void *monitorPollThread(void *arg) {
+	int type = *(int *) arg;
+	struct timespec now, next;
+	int i;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		next = now;
+		monitorAddMs(&next, 1000);
+		for (i = 0; i < monitorChannelsCount; i++) {
+			struct MonitorChannel *ch = &monitorChannels[i];
+			if (ch->type != type) {
+				continue;
+			}
+			if (!monitorBefore(&now, &ch->next)) {
+				if (type == MONITOR_TYPE_AI) {
+					if (monitorFormat == MONITOR_BIN) {
+						int v = ionoPiAnalogRead(ch->pin);
+						if (v >= 0) {
+							monitorEmit(ch, v, 0);
+						}
+					} else {
+						float v = ionoPiVoltageRead(ch->pin);
+						if (v >= 0) {
+							monitorEmit(ch, (uint64_t) (v * 1000 + 0.5f), 0);
+						}
+					}
+				} else {
+					int temp;
+					if (ionoPi1WireBusReadTemperature(ch->deviceId, 3,
+							&temp)) {
+						monitorEmit(ch, (int64_t) temp, 0);
+					}
+				}
+				monitorAddMs(&ch->next, ch->period_ms);
+				if (monitorBefore(&ch->next, &now)) {
+					// overrun, skip missed samples
+					ch->next = now;
+					monitorAddMs(&ch->next, ch->period_ms);
+				}
+			}
+			if (monitorBefore(&ch->next, &next)) {
+				next = ch->next;
+			}
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+/*
+ *
+ */
+int monitorAddChannel(int type, int index, int pin, const char *name,
+		char *deviceId, unsigned long int period_ms) {
+	if (monitorChannelsCount >= MONITOR_MAX_CHANNELS) {
+		return FALSE;
+	}
+	struct MonitorChannel *ch = &monitorChannels[monitorChannelsCount++];
+	ch->type = type;
+	ch->index = index;
+	ch->pin = pin;
+	snprintf(ch->name, sizeof(ch->name), "%s", name);
+	ch->deviceId = deviceId;
+	ch->period_ms = period_ms;
+	return TRUE;
+}
+
+/*
+ *
+ */
+int monitorParseChannel(char *spec) {
+	static const int diPins[] = { DI1, DI2, DI3, DI4, DI5, DI6 };
+	static const int ttlPins[] = { TTL1, TTL2, TTL3, TTL4 };
+	static const int aiPins[] = { AI1, AI2, AI3, AI4 };
+	unsigned long int period_ms = 0;
+	char *at = strchr(spec, '@');
+	if (at != NULL) {
+		*at = '\0';
+		period_ms = strtoul(at + 1, NULL, 10);
+		if (period_ms == 0) {
+			return FALSE;
+		}
+	}
+
+	int len = strlen(spec);
+	int n = len > 0 ? spec[len - 1] - '0' : -1;
+
+	if (len == 3 && strncmp(spec, "di", 2) == 0 && n >= 1 && n <= 6) {
+		return at == NULL
+				&& monitorAddChannel(MONITOR_TYPE_DI, n, diPins[n - 1], spec,
+						NULL, 0);
+	}
+	if (len == 4 && strncmp(spec, "ttl", 3) == 0 && n >= 1 && n <= 4) {
+		return at == NULL
+				&& monitorAddChannel(MONITOR_TYPE_TTL, n, ttlPins[n - 1], spec,
+						NULL, 0);
+	}
+	if (len == 3 && strncmp(spec, "ai", 2) == 0 && n >= 1 && n <= 4) {
+		return monitorAddChannel(MONITOR_TYPE_AI, n, aiPins[n - 1], spec,
+				NULL, period_ms > 0 ? period_ms : MONITOR_AI_PERIOD_MS);
+	}
+	if (len == 8 && strncmp(spec, "wiegand", 7) == 0 && n >= 1 && n <= 2) {
+		return at == NULL
+				&& monitorAddChannel(MONITOR_TYPE_WIEGAND, n, -1, spec, NULL,
+						0);
+	}
+	if (strcmp(spec, "1wire") == 0) {
+		char** ids = NULL;
+		int count = ionoPi1WireBusGetDevices(&ids);
+		if (count < 0) {
+			fprintf(stderr, "1-Wire bus error\n");
+			return FALSE;
+		}
+		int i;
+		for (i = 0; i < count; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "1wire:%s", ids[i]);
+			if (!monitorAddChannel(MONITOR_TYPE_1WIRE, ++monitorOneWireCount,
+					-1, name, ids[i],
+					period_ms > 0 ? period_ms : MONITOR_1WIRE_PERIOD_MS)) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+	if (strncmp(spec, "1wire:", 6) == 0 && len > 6) {
+		return monitorAddChannel(MONITOR_TYPE_1WIRE, ++monitorOneWireCount,
+				-1, spec, strdup(spec + 6),
+				period_ms > 0 ? period_ms : MONITOR_1WIRE_PERIOD_MS);
+	}
+	return FALSE;
+}
+
+/*
+ * Streams the selected channels until killed. Returns FALSE upon wrong
+ * arguments.
+ */
+int monitor(int argc, char *argv[]) {
+	static int aiType = MONITOR_TYPE_AI;
+	static int oneWireType = MONITOR_TYPE_1WIRE;
+	unsigned long int flush_ms = MONITOR_FLUSH_MS;
+	int debounce_ms = 0;
+	int hasAi = FALSE, hasOneWire = FALSE;
+	int ttlUsed[5] = { 0 };
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "csv") == 0) {
+				monitorFormat = MONITOR_CSV;
+			} else if (strcmp(argv[i], "json") == 0) {
+				monitorFormat = MONITOR_JSON;
+			} else if (strcmp(argv[i], "bin") == 0) {
+				monitorFormat = MONITOR_BIN;
+			} else {
+				return FALSE;
+			}
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			flush_ms = strtoul(argv[++i], NULL, 10);
+			if (flush_ms == 0) {
+				return FALSE;
+			}
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			debounce_ms = atoi(argv[++i]);
+		} else if (!monitorParseChannel(argv[i])) {
+			return FALSE;
+		}
+	}
+
+	if (monitorChannelsCount == 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < monitorChannelsCount; i++) {
+		struct MonitorChannel *ch = &monitorChannels[i];
+		if (ch->type == MONITOR_TYPE_TTL) {
+			ttlUsed[ch->index]++;
+		} else if (ch->type == MONITOR_TYPE_WIEGAND) {
+			ttlUsed[ch->index * 2 - 1]++;
+			ttlUsed[ch->index * 2]++;
+		}
+	}
+	for (i = 1; i <= 4; i++) {
+		if (ttlUsed[i] > 1) {
+			fprintf(stderr, "TTL%d used by more than one channel\n", i);
+			return FALSE;
+		}
+	}
+
+	static char stdoutBuf[BUFSIZ];
+	setvbuf(stdout, stdoutBuf, _IOFBF, sizeof(stdoutBuf));
+
+	if (monitorFormat == MONITOR_BIN) {
+		for (i = 0; i < monitorChannelsCount; i++) {
+			fprintf(stderr, "%d %d %s\n", monitorChannels[i].type,
+					monitorChannels[i].index, monitorChannels[i].name);
+		}
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < monitorChannelsCount; i++) {
+		struct MonitorChannel *ch = &monitorChannels[i];
+		ch->next = now;
+		switch (ch->type) {
+		case MONITOR_TYPE_DI:
+		case MONITOR_TYPE_TTL:
+			if (ch->type == MONITOR_TYPE_TTL) {
+				ionoPiPinMode(ch->pin, INPUT);
+			}
+			if (debounce_ms > 0) {
+				ionoPiSetDigitalDebounce(ch->pin, debounce_ms);
+			}
+			monitorEmit(ch, ionoPiDigitalRead(ch->pin), 0);
+			ionoPiDigitalInterrupt(ch->pin, INT_EDGE_BOTH, monitorDigitalCB);
+			break;
+		case MONITOR_TYPE_AI:
+			hasAi = TRUE;
+			break;
+		case MONITOR_TYPE_1WIRE:
+			hasOneWire = TRUE;
+			break;
+		case MONITOR_TYPE_WIEGAND:
+			if (pthread_create(&thread, NULL, monitorWiegandThread, ch) != 0) {
+				fprintf(stderr, "error creating Wiegand thread\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+	}
+
+	if (hasAi && pthread_create(&thread, NULL, monitorPollThread, &aiType)) {
+		fprintf(stderr, "error creating analog thread\n");
+		exit(EXIT_FAILURE);
+	}
+	if (hasOneWire
+			&& pthread_create(&thread, NULL, monitorPollThread, &oneWireType)) {
+		fprintf(stderr, "error creating 1-Wire thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		monitorAddMs(&now, flush_ms);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &now, NULL);
+		pthread_mutex_lock(&monitorMutex);
+		if (fflush(stdout) != 0) {
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_unlock(&monitorMutex);
+	}
+
+	return TRUE;
+}
+
+volatile sig_atomic_t captureRun;
+
+void captureStop(int sig) {
+	captureRun = 0;
+}
+
+/*
+ * Records the selected analog inputs to a capture file until interrupted.
+ * Returns FALSE upon wrong arguments.
+ */
+int capture(int argc, char *argv[]) {
+	int ais[4];
+	int count = 0;
+	unsigned long int period_ms = 1000;
+	unsigned int flushChunks = 16;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			period_ms = strtoul(argv[++i], NULL, 10);
+			if (period_ms == 0) {
+				return FALSE;
+			}
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			flushChunks = strtoul(argv[++i], NULL, 10);
+		} else if (strlen(argv[i]) == 3 && strncmp(argv[i], "ai", 2) == 0
+				&& argv[i][2] >= '1' && argv[i][2] <= '4' && count < 4) {
+			static const int aiPins[] = { AI1, AI2, AI3, AI4 };
+			ais[count++] = aiPins[argv[i][2] - '1'];
+		} else {
+			return FALSE;
+		}
+	}
+
+	if (count == 0) {
+		return FALSE;
+	}
+
+	struct IonoPiCapture *cap = ionoPiCaptureCreate(argv[0], ais, count,
+			period_ms * 1000, 1024, flushChunks);
+	if (cap == NULL) {
+		fprintf(stderr, "capture file error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	captureRun = 1;
+	signal(SIGINT, captureStop);
+	signal(SIGTERM, captureStop);
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (captureRun) {
+		if (!ionoPiCaptureSample(cap)) {
+			fprintf(stderr, "capture error\n");
+			break;
+		}
+		monitorAddMs(&next, period_ms);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	if (!ionoPiCaptureClose(cap)) {
+		fprintf(stderr, "capture file error\n");
+		exit(EXIT_FAILURE);
+	}
+	return TRUE;
+}
+
+int exportAis[4];
+int exportRaw;
+
+int printCaptureSample(uint64_t tsMicros, int count, const int* values) {
+	int i;
+	printf("%ju", (uintmax_t) (tsMicros / 1000));
+	for (i = 0; i < count; i++) {
+		if (exportRaw) {
+			printf(",%d", values[i]);
+		} else {
+			printf(",%.3f", ionoPiRawToVoltage(exportAis[i], values[i]));
+		}
+	}
+	printf("\n");
+	return TRUE;
+}
+
+/*
+ * Prints the samples of a capture file in the given time range as CSV.
+ * Returns FALSE upon wrong arguments.
+ */
+int exportCapture(int argc, char *argv[]) {
+	uint64_t from = 0, to = UINT64_MAX;
+	int count, i, n = 0;
+
+	exportRaw = FALSE;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) {
+			exportRaw = TRUE;
+		} else if (n < 2) {
+			char *end;
+			double t = strtod(argv[i], &end);
+			if (*end != '\0' || t < 0) {
+				return FALSE;
+			}
+			if (n++ == 0) {
+				from = t * 1000000;
+			} else {
+				to = t * 1000000;
+			}
+		} else {
+			return FALSE;
+		}
+	}
+
+	struct IonoPiCapture *cap = ionoPiCaptureOpen(argv[0]);
+	if (cap == NULL) {
+		fprintf(stderr, "capture file error\n");
+		exit(EXIT_FAILURE);
+	}
+	ionoPiCaptureInfo(cap, exportAis, &count, NULL, NULL, NULL);
+	if (!ionoPiCaptureRead(cap, from, to, printCaptureSample)) {
+		fprintf(stderr, "capture file corrupted\n");
+	}
+	ionoPiCaptureClose(cap);
+	return TRUE;
+}
+
+void publishStop(int sig) {
+	ionoPiStatePublishStop();
+}
+
+/*
+ * Publishes the I/O state in shared memory until interrupted.
+ * Returns FALSE upon wrong arguments.
+ */
+int publish(int argc, char *argv[]) {
+	unsigned int period_ms = 100;
+	unsigned int oneWirePeriod_ms = 0;
+	char *name = NULL;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			period_ms = strtoul(argv[++i], NULL, 10);
+			if (period_ms == 0) {
+				return FALSE;
+			}
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			oneWirePeriod_ms = strtoul(argv[++i], NULL, 10);
+		} else if (name == NULL && argv[i][0] == '/') {
+			name = argv[i];
+		} else {
+			return FALSE;
+		}
+	}
+
+	signal(SIGINT, publishStop);
+	signal(SIGTERM, publishStop);
+
+	if (!ionoPiStatePublish(name, period_ms, oneWirePeriod_ms)) {
+		fprintf(stderr, "shared memory error\n");
+		exit(EXIT_FAILURE);
+	}
+	return TRUE;
+}
+
+/*
+ * Prints the I/O state read from shared memory.
+ */
+int printState(char *name) {
+	struct IonoPiState state;
+	int i;
+
+	struct IonoPiStateShm *shm = ionoPiStateOpen(name);
+	if (shm == NULL || !ionoPiStateRead(shm, &state)) {
+		fprintf(stderr, "shared memory error\n");
+		exit(EXIT_FAILURE);
+	}
+	ionoPiStateClose(shm);
+
+	printf("seq %u\n", state.seq);
+	for (i = 0; i < 6; i++) {
+		printf("di%d %s\n", i + 1, state.di[i] == HIGH ? "high" : "low");
+	}
+	for (i = 0; i < 4; i++) {
+		printf("ttl%d %s\n", i + 1, state.ttl[i] == HIGH ? "high" : "low");
+	}
+	for (i = 0; i < 4; i++) {
+		printf("o%d %s\n", i + 1, state.o[i] == CLOSED ? "closed" : "open");
+	}
+	for (i = 0; i < 3; i++) {
+		printf("oc%d %s\n", i + 1, state.oc[i] == CLOSED ? "closed" : "open");
+	}
+	printf("led %s\n", state.led == ON ? "on" : "off");
+	static const int ais[] = { AI1, AI2, AI3, AI4 };
+	for (i = 0; i < 4; i++) {
+		printf("ai%d %f\n", i + 1, ionoPiRawToVoltage(ais[i], state.ai[i]));
+	}
+	for (i = 0; i < (int) state.oneWireCount; i++) {
+		printf("1wire %s %.3f\n", state.oneWireIds[i],
+				state.oneWireTemp[i] / 1000.0);
+	}
+	return TRUE;
+}
+
 int main(int argc, char *argv[]) {
-	if (!ionoPiSetup()) {
+	if ((argc == 2 || argc == 3) && strcmp(argv[1], "state") == 0) {
+		// reads the shared memory only, no setup needed
+		exit(printState(argc == 3 ? argv[2] : NULL) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (!ionoPiSetupEx(IONOPI_SETUP_ALL & ~IONOPI_SETUP_ANALOG)) {
 		fprintf(stderr, "ionoPi setup error\n");
 		exit(EXIT_FAILURE);
 	}
@@ -114,9 +734,53 @@ int main(int argc, char *argv[]) {
 						fprintf(stderr, "1-Wire bus error\n");
 					}
 					ok = 1;
+				} else if ((argc == 5 || argc == 6)
+						&& strcmp(argv[4], "resolution") == 0) {
+					int bits;
+					unsigned int convMillis;
+					if (argc == 6 && !ionoPi1WireBusSetResolution(argv[3],
+							atoi(argv[5]))) {
+						fprintf(stderr, "1-Wire bus error\n");
+					} else if (ionoPi1WireBusGetResolution(argv[3], &bits,
+							&convMillis)) {
+						printf("%d %u\n", bits, convMillis);
+					} else {
+						fprintf(stderr, "1-Wire bus error\n");
+					}
+					ok = 1;
 				}
 			}
 
+		} else if (argc >= 3 && strcmp(cmd, "monitor") == 0) {
+			ok = monitor(argc - 2, argv + 2);
+
+		} else if (argc >= 4 && strcmp(cmd, "capture") == 0) {
+			ok = capture(argc - 2, argv + 2);
+
+		} else if (argc >= 3 && strcmp(cmd, "export") == 0) {
+			ok = exportCapture(argc - 2, argv + 2);
+
+		} else if (argc >= 2 && strcmp(cmd, "publish") == 0) {
+			ok = publish(argc - 2, argv + 2);
+
+		} else if (argc == 3 && strcmp(cmd, "adc") == 0) {
+			if (strcmp(argv[2], "speed") == 0) {
+				if (ionoPiSetupEx(IONOPI_SETUP_ANALOG)) {
+					printf("%d\n", ionoPiGetAnalogSpeed());
+				} else {
+					fprintf(stderr, "SPI setup error\n");
+				}
+				ok = 1;
+			} else if (strcmp(argv[2], "calibrate") == 0) {
+				int speed = ionoPiAnalogCalibrateSpeed(TRUE);
+				if (speed > 0) {
+					printf("%d\n", speed);
+				} else {
+					fprintf(stderr, "calibration error\n");
+				}
+				ok = 1;
+			}
+
 		} else if (argc >= 3 && strcmp(cmd, "wiegand") == 0) {
 			char *prm = argv[2];
 			int itf = -1;
@@ -126,7 +790,21 @@ int main(int argc, char *argv[]) {
 				itf = 2;
 			}
 
-			if (itf > 0) {
+			if (itf > 0 && argc == 6 && strcmp(argv[3], "send") == 0) {
+				char *end;
+				int bits = strtol(argv[4], &end, 10);
+				if (*end == '\0') {
+					uint64_t data = strtoull(argv[5], &end, 0);
+					if (*end == '\0') {
+						if (ionoPiWiegandSend(itf, data, bits)) {
+							ionoPiWiegandSendFlush(itf);
+						} else {
+							fprintf(stderr, "Wiegand error\n");
+						}
+						ok = 1;
+					}
+				}
+			} else if (itf > 0) {
 				if (argc == 4 && strcmp(argv[3], "-f") == 0) {
 					printWiegandCont = TRUE;
 				} else {
@@ -284,12 +962,41 @@ int main(int argc, char *argv[]) {
 						"                   to analog input ai<n> (<n>=1..4)\n"
 						"   1wire bus       Print the list of device IDs found on the 1-Wire bus\n"
 						"   1wire bus <id>  Print the temperature value (°C) read from 1-Wire device <id>\n"
+						"   1wire bus <id> resolution [<bits>]\n"
+						"                   Set the resolution of 1-Wire device <id> to <bits> (<bits>=9..12)\n"
+						"                   and print its resolution and conversion time (ms)\n"
 						"   1wire ttl<n>    Print temperature (°C) and humidity (%%) values read from the\n"
 						"                   MaxDetect 1-Wire sensor on TTL<n> (<n>=1..4)\n"
 						"   wiegand <n>     Wait for data to be available on Wiegand interface <n> (<n>=1|2)\n"
 						"                   and print number of bits and value read\n"
 						"   wiegand <n> -f  Continuously print number of bits and value read from Wiegand\n"
-						"                   interface <n> whenever data is available\n");
+						"                   interface <n> whenever data is available\n"
+						"   wiegand <n> send <bits> <value>\n"
+						"                   Send <value> (decimal or 0x hexadecimal) as a <bits>-bit frame\n"
+						"                   (<bits>=1..64) on Wiegand interface <n>\n"
+						"   monitor [-o csv|json|bin] [-b <ms>] [-d <ms>] <ch>...\n"
+						"                   Stream the selected channels from a single process. <ch> can be\n"
+						"                   di<n>, ttl<n>, wiegand<n> (sent on every change), ai<n>[@<ms>],\n"
+						"                   1wire[@<ms>] (all bus devices) or 1wire:<id>[@<ms>] (sampled every\n"
+						"                   <ms>, default 1000 for ai, 10000 for 1wire). -o sets the output\n"
+						"                   format (default csv), -b the output flush interval (default 100 ms),\n"
+						"                   -d a debounce time for digital inputs\n"
+						"   capture <file> [-p <ms>] [-s <n>] ai<n>...\n"
+						"                   Record the raw values of the selected analog inputs to a compressed\n"
+						"                   capture file every <ms> (default 1000) until interrupted, syncing the\n"
+						"                   file to storage every <n> chunks of 1024 samples (default 16)\n"
+						"   export <file> [-r] [<from> [<to>]]\n"
+						"                   Print the samples of a capture file between Unix times <from> and\n"
+						"                   <to> (s) as CSV lines: timestamp (ms) followed by the voltage, or\n"
+						"                   the raw value with -r, of each recorded input\n"
+						"   publish [-p <ms>] [-w <ms>] [/<name>]\n"
+						"                   Publish the I/O state in shared memory /<name> (default /ionopi)\n"
+						"                   every <ms> (default 100) until interrupted, reading the 1-Wire\n"
+						"                   bus devices every -w <ms> (default disabled)\n"
+						"   state [/<name>] Print the I/O state read from shared memory /<name>\n"
+						"   adc speed       Print the SPI clock speed (Hz) used for the A/D converter\n"
+						"   adc calibrate   Find the fastest SPI clock speed giving stable readings of the\n"
+						"                   A/D converter and save it for later use\n");
 
 		exit(EXIT_FAILURE);
 	}